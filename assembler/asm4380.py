@@ -1,17 +1,45 @@
+# Assembler for the 4380 ISA.
+#
+# As a library:
+#   assemble(source) -> bytes         source is a string or an open text file
+#   assemble_file(path) -> bytes
+# Both take the same options as the command line (v2, optimize, jobs) and
+# raise AssemblerError with the failing line instead of exiting.
+#
+# Run as a script it is the command line tool, see usage_error in asm_types.py.
+import os
 import re
 import sys
+from typing import Iterable, Iterator, TextIO
 
+import optimizer
 from asm_types import AssemblerError, usage_error, assembler_error, AsmState, AsmLine
-from states import LineStart, LineEnd
+from bin_format import to_v2
+from cache import AssemblyCache, default_cache_dir
+from parallel import assemble_parallel
+from states import assemble_line
+from streaming import StreamingBytecode, SpilledLabelMarkers, SpillList
 
-if len(sys.argv) != 2:
-    usage_error()
 
-in_path = sys.argv[1]
-out_path = re.sub("asm$", "bin", in_path)
+def source_lines(source: str | Iterable[str]) -> Iterator[str]:
+    # every line ends in a newline, including the last one
+    if isinstance(source, str):
+        source = source.splitlines(keepends=True)
+    for line in source:
+        yield line if line.endswith("\n") else line + "\n"
 
-state = LineStart()
-line_num = 0
+def assemble_lines(asm_state: AsmState, lines: Iterable[str], record_lines: bool) -> int:
+    # returns the number of lines
+    line_num = 0
+    for line in lines:
+        line_num += 1
+        asm_line = AsmLine(line[0:-1], line_num)
+        line_address = len(asm_state.bytecode)
+        assemble_line(asm_state, asm_line)
+
+        if record_lines and len(asm_state.bytecode) != line_address:
+            asm_state.line_table.append((line_address, line_num))
+    return line_num
 
 def labels_to_addresses(asm_state: AsmState, last_line: int):
     for label_marker in asm_state.label_list:
@@ -20,29 +48,156 @@ def labels_to_addresses(asm_state: AsmState, last_line: int):
             raise AssemblerError(last_line)
 
         address = asm_state.label_map[label_marker.label]
-        addr_bytes = address.to_bytes(4, byteorder="little", signed=False)
-        for i in range(4):
-            asm_state.bytecode[i + label_marker.location] = addr_bytes[i]
+        location = label_marker.location
+        asm_state.bytecode[location:location + 4] = address.to_bytes(4, byteorder="little", signed=False)
 
-try:
-    with open(in_path, "r") as in_file:
+def build(source: str | Iterable[str], optimize: bool = False, jobs: int = 0, cache: AssemblyCache | None = None,
+          record_lines: bool = False) -> AsmState:
+    # the assembled, optimized and linked program. Parallel and cached
+    # assembly always record the line table.
+    if jobs or cache is not None:
+        lines = list(source_lines(source))
+        asm_state = assemble_parallel(lines, max(jobs, 1), cache)
+        line_num = len(lines)
+    else:
         asm_state = AsmState()
-        for line in in_file:
-            line_num += 1
-            asm_line = AsmLine(line[0:-1], line_num)
+        line_num = assemble_lines(asm_state, source_lines(source), record_lines)
+
+    if optimize:
+        optimizer.optimize(asm_state)
+    labels_to_addresses(asm_state, line_num)
+    return asm_state
+
+def binary(asm_state: AsmState, v2: bool = False) -> bytes:
+    if v2:
+        return to_v2(asm_state.bytecode, asm_state.code_start)
+    return bytes(asm_state.bytecode)
+
+def assemble(source: str | TextIO, v2: bool = False, optimize: bool = False, jobs: int = 0) -> bytes:
+    return binary(build(source, optimize, jobs), v2)
+
+def assemble_file(path: str, v2: bool = False, optimize: bool = False, jobs: int = 0) -> bytes:
+    with open(path, "r") as in_file:
+        return assemble(in_file, v2, optimize, jobs)
+
+def write_symbols(asm_state: AsmState, path: str):
+    # plain text sidecar read by the emulator's profiler: one "label" record
+    # per label and one "line" record per source line that emitted bytes
+    with open(path, "w") as sym_file:
+        sym_file.write("# asm4380 symbols v1\n")
+        for label, address in sorted(asm_state.label_map.items(), key=lambda item: item[1]):
+            sym_file.write(f"label {address} {asm_state.label_lines[label]} {label}\n")
+        for address, line in asm_state.line_table:
+            sym_file.write(f"line {address} {line}\n")
+
+
+def pipe(flags: list[str], jobs: int):
+    # source from stdin, binary to stdout framed by its u32 length so the
+    # emulator can read it with "-" and pass anything after it on as input
+    if "--symbols" in flags or "--stream" in flags:
+        usage_error()
+    try:
+        data = binary(build(sys.stdin, "--optimize" in flags, jobs), "--v2" in flags)
+    except AssemblerError as e:
+        # stdout is the binary
+        assembler_error(e, sys.stderr)
+    sys.stdout.buffer.write(len(data).to_bytes(4, byteorder="little") + data)
+    sys.stdout.flush()
+
+def main(args: list[str]):
+    flags = [arg for arg in args if arg.startswith("--")]
+    positional = [arg for arg in args if not arg.startswith("--")]
+    # --parallel takes an optional job count and --cache an optional directory,
+    # the other flags take no value
+    jobs = 0
+    cache_dir = None
+    for flag in [flag for flag in flags if flag.startswith("--parallel") or flag.startswith("--cache")]:
+        name, equals, value = flag.partition("=")
+        if name == "--parallel" and not equals:
+            jobs = os.cpu_count() or 1
+        elif name == "--parallel" and value.isdigit() and int(value) > 0:
+            jobs = int(value)
+        elif name == "--cache" and not equals:
+            cache_dir = default_cache_dir
+        elif name == "--cache" and value:
+            cache_dir = value
+        else:
+            usage_error()
+        flags.remove(flag)
+
+    if len(positional) != 1 or any(flag not in ("--symbols", "--v2", "--optimize", "--stream") for flag in flags):
+        usage_error()
+    # the optimizer and version 2 output need the whole program in memory, and
+    # parallel and cached assembly build it there
+    if "--stream" in flags and ("--v2" in flags or "--optimize" in flags or jobs or cache_dir):
+        usage_error()
+    # ASM4380_CACHE turns the cache on for runs that can use it
+    if cache_dir is None and "--stream" not in flags:
+        cache_dir = os.environ.get("ASM4380_CACHE")
+
+    in_path = positional[0]
+    if in_path == "-":
+        pipe(flags, jobs)
+        return
+
+    out_path = re.sub("asm$", "bin", in_path)
+    sym_path = re.sub("asm$", "sym", in_path)
+    write_symbol_file = "--symbols" in flags
+    write_v2 = "--v2" in flags
+    run_optimizer = "--optimize" in flags
+    stream = "--stream" in flags
+
+    # output file written while assembling in streaming mode
+    out_file = None
+
+    try:
+        with open(in_path, "r") as in_file:
+            if stream:
+                out_file = open(out_path, "wb+")
+                asm_state = AsmState(StreamingBytecode(out_file), SpilledLabelMarkers(), SpillList("<QQ"))
+                line_num = assemble_lines(asm_state, source_lines(in_file), write_symbol_file)
+                labels_to_addresses(asm_state, line_num)
+                asm_state.bytecode.flush()
+                out_file.close()
+            elif cache_dir:
+                lines = in_file.readlines()
+                cache = AssemblyCache(cache_dir)
+
+                # unchanged source and flags: reuse the last outputs
+                suffixes = [".bin", ".sym"] if write_symbol_file else [".bin"]
+                output_key = cache.key("".join(lines).encode(), " ".join(sorted(flags)).encode())
+                outputs = cache.get_outputs(output_key, suffixes)
+                if outputs is None:
+                    # otherwise only chunks that changed are assembled again
+                    asm_state = build(lines, run_optimizer, jobs, cache)
+                    outputs = {".bin": binary(asm_state, write_v2)}
+                    if write_symbol_file:
+                        write_symbols(asm_state, sym_path)
+                        with open(sym_path, "rb") as sym_file:
+                            outputs[".sym"] = sym_file.read()
+                    cache.put_outputs(output_key, outputs)
 
-            state = LineStart()
+                for suffix, data in outputs.items():
+                    with open(out_path if suffix == ".bin" else sym_path, "wb") as out:
+                        out.write(data)
+                return
+            else:
+                asm_state = build(in_file, run_optimizer, jobs, record_lines=write_symbol_file)
+                with open(out_path, "wb") as bin_file:
+                    bin_file.write(binary(asm_state, write_v2))
 
-            while not type(state) is LineEnd:
-                next_state = state.run(asm_state, asm_line)
-                state = next_state
+            if write_symbol_file:
+                write_symbols(asm_state, sym_path)
 
-        labels_to_addresses(asm_state, line_num)
+    except FileNotFoundError:
+        usage_error()
+    except AssemblerError as e:
+        # don't leave a partial streamed binary behind
+        if out_file is not None:
+            out_file.close()
+            os.remove(out_path)
+        assembler_error(e)
 
-        with open(out_path, "wb") as bin_file:
-            bin_file.write(asm_state.bytecode)
 
-except FileNotFoundError:
-    usage_error()
-except AssemblerError as e:
-    assembler_error(e)
\ No newline at end of file
+if __name__ == "__main__":
+    main(sys.argv[1:])
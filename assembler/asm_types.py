@@ -1,6 +1,6 @@
 import sys
 from enum import Enum
-from typing import NoReturn
+from typing import NoReturn, TextIO
 
 
 class AssemblerError(Exception):
@@ -21,6 +21,7 @@ class OperandType(Enum):
     DC_I = 1
     Register = 2
     Immediate = 3
+    TrapCode = 4
 
 class AsmLine:
     def __init__(self, line: str, line_num: int):
@@ -29,21 +30,27 @@ class AsmLine:
         self.index: int = 0
 
 class AsmState:
-    def __init__(self):
-        self.bytecode = bytearray()
+    # bytecode, label_list and line_table can be replaced by the streaming
+    # versions in streaming.py, which only support appending and patching
+    def __init__(self, bytecode=None, label_list=None, line_table=None):
+        self.bytecode = bytecode if bytecode is not None else bytearray()
         self.label_map: dict[str, int] = dict()
-        self.label_list: list[LabelMarker] = list()
+        self.label_list: list[LabelMarker] = label_list if label_list is not None else list()
+        # source line of each label and (address, line) for each line that emits bytes
+        self.label_lines: dict[str, int] = dict()
+        self.line_table: list[tuple[int, int]] = line_table if line_table is not None else list()
 
         self.stage = Stage.Data
+        # address of the first instruction, None until the code stage starts
+        self.code_start: int | None = None
+
+        self.bytecode.extend(bytes(4))
 
-        for i in range(4):
-            self.bytecode.append(0)
-        
 
 def usage_error() -> NoReturn:
-    print("USAGE: python3 asm4380.py inputFile.asm")
+    print("USAGE: python3 asm4380.py [--symbols] [--v2] [--optimize] [--stream] [--parallel[=jobs]] [--cache[=dir]] inputFile.asm|-")
     sys.exit(1)
 
-def assembler_error(e: AssemblerError):
-    print("Assembler error encountered on line " + str(e.lineNum) + "!")
+def assembler_error(e: AssemblerError, out: TextIO = sys.stdout):
+    print("Assembler error encountered on line " + str(e.lineNum) + "!", file=out)
     sys.exit(2)
\ No newline at end of file
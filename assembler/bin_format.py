@@ -0,0 +1,64 @@
+import re
+import struct
+
+# Version 2 binaries start with a 48 byte header (all little endian):
+#
+#   0  magic "4380"         24  bss size (zero bytes after the data)
+#   4  u16 version (2)      28  code file offset
+#   6  u16 header size      32  code address
+#   8  entry address        36  code size
+#  12  data file offset     40  u64 FNV-1a hash of bytes 0-39, data and code
+#  16  data address
+#  20  data size
+#
+# The data segment is loaded at address 4 and the code segment right after
+# the data and bss, so memory looks exactly like it does for a version 1
+# binary. Trailing zero bytes of the data segment are not stored, but zero
+# runs inside the data or the code are, as the header only has room for the
+# one bss run between the two segments.
+V2_MAGIC = b"4380"
+V2_VERSION = 2
+V2_HEADER_SIZE = 48
+
+FNV_OFFSET = 0xcbf29ce484222325
+FNV_PRIME = 0x100000001b3
+FNV_MASK = 0xFFFFFFFFFFFFFFFF
+# XOR with a zero byte does nothing, so a run of n zeros only multiplies the
+# hash by FNV_PRIME ** n. Runs shorter than this aren't worth the regex match.
+LONG_ZERO_RUN = re.compile(b"\0{64,}")
+
+
+def fnv1a_64_bytes(data: bytes, hash_value: int) -> int:
+    for byte in data:
+        hash_value = ((hash_value ^ byte) * FNV_PRIME) & FNV_MASK
+    return hash_value
+
+
+# FNV-1a has to be computed a byte at a time, which is slow in Python (about
+# 4 MB/s), so long zero runs are skipped in one step.
+def fnv1a_64(data: bytes, hash_value: int = FNV_OFFSET) -> int:
+    start = 0
+    for run in LONG_ZERO_RUN.finditer(data):
+        hash_value = fnv1a_64_bytes(data[start:run.start()], hash_value)
+        hash_value = (hash_value * pow(FNV_PRIME, run.end() - run.start(), FNV_MASK + 1)) & FNV_MASK
+        start = run.end()
+    return fnv1a_64_bytes(data[start:], hash_value)
+
+
+def to_v2(bytecode: bytes | bytearray, code_start: int | None) -> bytes:
+    # no instructions means an empty code segment
+    if code_start is None:
+        code_start = len(bytecode)
+
+    entry = int.from_bytes(bytecode[0:4], byteorder="little", signed=False)
+    data = bytes(bytecode[4:code_start])
+    stored_data = data.rstrip(b"\0")
+    bss_size = len(data) - len(stored_data)
+    code = bytes(bytecode[code_start:])
+
+    header = struct.pack("<4sHHIIIIIIII", V2_MAGIC, V2_VERSION, V2_HEADER_SIZE, entry,
+                         V2_HEADER_SIZE, 4, len(stored_data), bss_size,
+                         V2_HEADER_SIZE + len(stored_data), code_start, len(code))
+    content_hash = fnv1a_64(header + stored_data + code)
+
+    return header + struct.pack("<Q", content_hash) + stored_data + code
@@ -0,0 +1,75 @@
+# Assembly cache, keyed by SHA-256 hashes that include the assembler's own
+# source so a change to the assembler invalidates everything.
+#
+#   outputs/<key>.bin, .sym   finished outputs for a whole source file and
+#                             the flags that change the output
+#   fragments/<key>           pickled parallel.Fragment for a chunk of lines
+#
+# Files are written to a temporary name and renamed, so concurrent runs
+# sharing a cache never see partial entries. Nothing is ever evicted.
+import hashlib
+import os
+import pickle
+import tempfile
+
+from parallel import Fragment
+
+default_cache_dir = os.path.join(os.path.expanduser("~"), ".cache", "asm4380")
+
+
+def assembler_version() -> bytes:
+    assembler_dir = os.path.dirname(os.path.abspath(__file__))
+    version = hashlib.sha256()
+    for name in sorted(os.listdir(assembler_dir)):
+        if name.endswith(".py") and not name.startswith("test_"):
+            with open(os.path.join(assembler_dir, name), "rb") as source:
+                version.update(name.encode() + b"\0" + source.read())
+    return version.digest()
+
+
+class AssemblyCache:
+    def __init__(self, cache_dir: str):
+        self.outputs_dir = os.path.join(cache_dir, "outputs")
+        self.fragments_dir = os.path.join(cache_dir, "fragments")
+        os.makedirs(self.outputs_dir, exist_ok=True)
+        os.makedirs(self.fragments_dir, exist_ok=True)
+        self.version = assembler_version()
+
+    def key(self, *parts: bytes) -> str:
+        digest = hashlib.sha256(self.version)
+        for part in parts:
+            # length prefixed so parts can't run into each other
+            digest.update(len(part).to_bytes(8, byteorder="little") + part)
+        return digest.hexdigest()
+
+    def get_outputs(self, key: str, suffixes: list[str]) -> dict[str, bytes] | None:
+        outputs = dict()
+        for suffix in suffixes:
+            try:
+                with open(os.path.join(self.outputs_dir, key + suffix), "rb") as cached:
+                    outputs[suffix] = cached.read()
+            except FileNotFoundError:
+                return None
+        return outputs
+
+    def put_outputs(self, key: str, outputs: dict[str, bytes]):
+        for suffix, data in outputs.items():
+            self.write(os.path.join(self.outputs_dir, key + suffix), data)
+
+    # fragment cache used by parallel.assemble_parallel
+    def get(self, lines: list[str]) -> Fragment | None:
+        try:
+            with open(os.path.join(self.fragments_dir, self.key("".join(lines).encode())), "rb") as cached:
+                return pickle.load(cached)
+        except (FileNotFoundError, pickle.UnpicklingError, EOFError):
+            return None
+
+    def put(self, lines: list[str], fragment: Fragment):
+        path = os.path.join(self.fragments_dir, self.key("".join(lines).encode()))
+        self.write(path, pickle.dumps(fragment))
+
+    def write(self, path: str, data: bytes):
+        fd, temp_path = tempfile.mkstemp(dir=os.path.dirname(path))
+        with os.fdopen(fd, "wb") as temp_file:
+            temp_file.write(data)
+        os.replace(temp_path, path)
@@ -0,0 +1,41 @@
+# Line lexer: one precompiled regular expression that splits a well formed
+# line into its tokens in a single match.
+#
+# It only matches a strict subset of what the states in states.py accept:
+# ASCII lines with whitespace between the label, the operation and the
+# operands, and no unknown escapes. Anything else, including every line with
+# an error, is left to the states, so errors are still reported on the same
+# line and odd but valid spellings like "TRP#0" still assemble.
+import re
+
+_name = r"[A-Za-z0-9_$]+"
+_number = r"#-?[0-9]+"
+_char = r"'(?:[^'\\]|\\[tn\\'\"rb])'"
+_string = r'"(?:[^"\\]|\\[tn\\\'"rb])*"'
+_register = r"[A-Za-z0-9]+"
+
+LINE = re.compile(
+    # an optional label in the first column
+    r"(?P<label>[A-Za-z0-9][A-Za-z0-9_$]*)?"
+    r"(?:[ \t]+(?:"
+    # a directive and its optional operand
+    rf"\.(?P<directive>[A-Za-z]+)(?:[ \t]+(?P<value>{_number}|{_char}|{_string}))?"
+    # or an operation, up to three registers and a register or immediate
+    r"|(?P<operation>[A-Za-z]+)(?:[ \t]+"
+    rf"(?:(?P<reg1>{_register})[ \t]*,[ \t]*)?"
+    rf"(?:(?P<reg2>{_register})[ \t]*,[ \t]*)?"
+    rf"(?:(?P<reg3>{_register})[ \t]*,[ \t]*)?"
+    rf"(?P<last>{_number}|{_char}|{_name}))?"
+    r"))?"
+    # trailing whitespace and comment
+    r"[ \t]*(?:;.*)?")
+
+# escape sequence in a char or string token
+ESCAPE = re.compile(r"\\(.)")
+
+
+def lex(text: str) -> re.Match | None:
+    # None if the line needs the character level states
+    if not text.isascii():
+        return None
+    return LINE.fullmatch(text)
@@ -0,0 +1,226 @@
+# Peephole optimizer, run on the parsed program before labels are resolved.
+#
+# Works on the instructions after code_start, one 8 byte slot each:
+#   - jumps to jumps go straight to the final target
+#   - MULI by 0, 1 or 2 becomes MOVI, MOV or ADD
+#   - MOVI followed by ADDI/SUBI/MULI of the same register folds into one
+#     MOVI, and ADDI/SUBI followed by ADDI/SUBI into one ADDI
+#   - no-ops (MOV Rx, Rx, ADDI/SUBI by 0, MULI/DIVI by 1, a jump to the next
+#     instruction) are removed
+#
+# Removing instructions moves the ones after them, so labels, label
+# references and the line table are relocated. Code that could reach an
+# instruction without a label (a numeric jump or data address into the code,
+# or a write to PC) keeps every instruction in place and only gets the in
+# place rewrites.
+from asm_types import AsmState, LabelMarker
+from states import bin_rep
+
+JMP, MOV, MOVI, LDA, STR, LDR, STB, LDB = 1, 7, 8, 9, 10, 11, 12, 13
+ADD, ADDI, SUB, SUBI, MUL, MULI, DIV, SDIV, DIVI, TRP = 18, 19, 20, 21, 22, 23, 24, 25, 26, 31
+CAS, FAA = 40, 41
+PC = bin_rep["PC"]
+
+# operations whose first operand is the register they write
+writes_operand_1 = {MOV, MOVI, LDA, LDR, LDB, ADD, ADDI, SUB, SUBI, MUL, MULI, DIV, SDIV, DIVI, CAS, FAA}
+# operations whose immediate is a data address
+memory_access = {LDA, STR, LDR, STB, LDB, CAS, FAA}
+# operations that can follow a constant into a fold
+foldable = {ADDI, SUBI, MULI}
+
+
+class Inst:
+    def __init__(self, slot: bytes, label: str | None, line: int | None):
+        self.operation = slot[0]
+        self.operands = [slot[1], slot[2], slot[3]]
+        self.immediate = int.from_bytes(slot[4:8], byteorder="little", signed=False)
+        self.label = label
+        self.line = line
+
+    def to_bytes(self) -> bytes:
+        return bytes([self.operation] + self.operands) + self.immediate.to_bytes(4, byteorder="little")
+
+    def is_noop(self) -> bool:
+        dest, src = self.operands[0], self.operands[1]
+        if self.operation == MOV:
+            return dest == src
+        if self.operation in (ADDI, SUBI) and self.label is None:
+            return dest == src and self.immediate == 0
+        if self.operation in (MULI, DIVI) and self.label is None:
+            return dest == src and self.immediate == 1
+        return False
+
+
+def signed(value: int) -> int:
+    value &= 0xFFFFFFFF
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+def apply(operation: int, value: int, immediate: int) -> int:
+    if operation == ADDI:
+        return (value + immediate) & 0xFFFFFFFF
+    if operation == SUBI:
+        return (value - immediate) & 0xFFFFFFFF
+    return (signed(value) * signed(immediate)) & 0xFFFFFFFF
+
+
+def read_code(asm_state: AsmState) -> list[Inst]:
+    markers = {marker.location: marker.label for marker in asm_state.label_list}
+    lines = dict(asm_state.line_table)
+
+    code = []
+    for address in range(asm_state.code_start, len(asm_state.bytecode), 8):
+        slot = bytes(asm_state.bytecode[address:address + 8])
+        code.append(Inst(slot, markers.get(address + 4), lines.get(address)))
+    return code
+
+
+def is_relocatable(asm_state: AsmState, code: list[Inst]) -> bool:
+    code_end = asm_state.code_start + 8 * len(code)
+    spawns = any(inst.operation == TRP and inst.immediate == 100 for inst in code)
+
+    for inst in code:
+        if inst.operation in writes_operand_1 and inst.operands[0] == PC and not inst.is_noop():
+            return False
+        if inst.label is not None:
+            continue
+        in_code = asm_state.code_start <= inst.immediate < code_end
+        if inst.operation == JMP:
+            return False
+        if inst.operation in memory_access and in_code:
+            return False
+        # a constant that may be the entry point of a spawned core
+        if inst.operation == MOVI and spawns and in_code:
+            return False
+    return True
+
+
+def thread_jumps(code: list[Inst], targets: dict[str, int]) -> bool:
+    changed = False
+    for inst in code:
+        if inst.operation != JMP or inst.label is None:
+            continue
+
+        seen = {inst.label}
+        label = inst.label
+        while label in targets:
+            target = code[targets[label]] if targets[label] < len(code) else None
+            if target is None or target.operation != JMP or target.label is None or target.label in seen:
+                break
+            label = target.label
+            seen.add(label)
+
+        if label != inst.label:
+            inst.label = label
+            changed = True
+    return changed
+
+
+def strength_reduce(inst: Inst) -> bool:
+    if inst.operation != MULI or inst.label is not None or inst.operands[0] == PC:
+        return False
+
+    dest, src = inst.operands[0], inst.operands[1]
+    if inst.immediate == 0:
+        inst.operation, inst.operands = MOVI, [dest, 0, 0]
+    elif inst.immediate == 1:
+        inst.operation, inst.operands, inst.immediate = MOV, [dest, src, 0], 0
+    elif inst.immediate == 2:
+        inst.operation, inst.operands, inst.immediate = ADD, [dest, src, src], 0
+    else:
+        return False
+    return True
+
+
+def try_fold(first: Inst, second: Inst) -> bool:
+    if first.label is not None or second.label is not None:
+        return False
+    if second.operation not in foldable:
+        return False
+
+    dest = first.operands[0]
+    if dest == PC or second.operands[0] != dest or second.operands[1] != dest:
+        return False
+
+    if first.operation == MOVI:
+        first.immediate = apply(second.operation, first.immediate, second.immediate)
+        return True
+    # ADDI/SUBI chains into the same register: x + a - b == x + (a - b)
+    if first.operation in (ADDI, SUBI) and second.operation in (ADDI, SUBI):
+        total = first.immediate if first.operation == ADDI else -first.immediate
+        total += second.immediate if second.operation == ADDI else -second.immediate
+        first.operation, first.immediate = ADDI, total & 0xFFFFFFFF
+        return True
+    return False
+
+
+def optimize(asm_state: AsmState):
+    # no code, nothing to do
+    if asm_state.code_start is None or asm_state.code_start >= len(asm_state.bytecode):
+        return
+
+    code = read_code(asm_state)
+    code_start = asm_state.code_start
+    relocatable = is_relocatable(asm_state, code)
+    referenced = {marker.label for marker in asm_state.label_list}
+
+    # index of the instruction each code label points at
+    targets = {label: (address - code_start) // 8 for label, address in asm_state.label_map.items()
+               if address >= code_start}
+
+    changed = True
+    while changed:
+        changed = thread_jumps(code, targets)
+        for inst in code:
+            changed = strength_reduce(inst) or changed
+
+        if not relocatable:
+            continue
+
+        # labels other code refers to, anything else may be folded away
+        jumped_to = {index for label, index in targets.items() if label in referenced}
+        keep = []
+        for index, inst in enumerate(code):
+            jump_to_next = inst.operation == JMP and targets.get(inst.label) == index + 1
+            removable = (inst.is_noop() or jump_to_next) and index != len(code) - 1
+            if removable:
+                changed = True
+            elif keep and index not in jumped_to and try_fold(keep[-1][1], inst):
+                changed = True
+            else:
+                keep.append((index, inst))
+                continue
+            # the dropped instruction's labels move to whatever comes next
+            for label, target in targets.items():
+                if target == index:
+                    targets[label] = index + 1
+                    if label in referenced:
+                        jumped_to.add(index + 1)
+
+        # renumber the labels to the kept instructions
+        new_index = {old: new for new, (old, inst) in enumerate(keep)}
+        new_index[len(code)] = len(keep)
+        for label in targets:
+            targets[label] = new_index[targets[label]]
+        code = [inst for index, inst in keep]
+
+    write_code(asm_state, code, targets)
+
+
+def write_code(asm_state: AsmState, code: list[Inst], targets: dict[str, int]):
+    code_start = asm_state.code_start
+    del asm_state.bytecode[code_start:]
+    asm_state.label_list = [marker for marker in asm_state.label_list if marker.location < code_start]
+    asm_state.line_table = [entry for entry in asm_state.line_table if entry[0] < code_start]
+
+    for inst in code:
+        address = len(asm_state.bytecode)
+        if inst.label is not None:
+            asm_state.label_list.append(LabelMarker(inst.label, address + 4))
+            inst.immediate = 0
+        if inst.line is not None:
+            asm_state.line_table.append((address, inst.line))
+        asm_state.bytecode.extend(inst.to_bytes())
+
+    for label, index in targets.items():
+        asm_state.label_map[label] = code_start + 8 * index
@@ -0,0 +1,139 @@
+# Parallel assembly: the source is split into chunks of lines that are
+# assembled on a process pool and then linked into one AsmState.
+#
+# A chunk is assembled on its own AsmState, so its bytes, labels, label
+# references and line numbers are relative to the start of the chunk and a
+# fragment can be reused wherever the same lines appear. Chunk boundaries are
+# picked from the content of the lines, so an edit only changes the chunks
+# around it and the rest still match the fragment cache. The only state a line
+# needs from earlier lines is the Data/Code stage. Chunks start in the data
+# stage and record the first directive they see before their own first
+# instruction; linking turns that into an error if an earlier chunk already
+# had code. Every chunk reports the first line it failed on and linking
+# raises the smallest of those lines, which is the line a serial pass would
+# have stopped on.
+import multiprocessing
+import zlib
+
+from asm_types import AsmState, AsmLine, AssemblerError, LabelMarker, Stage
+from states import assemble_line
+
+# chunks smaller than this aren't worth sending to another process. A chunk
+# ends at a line whose checksum is a multiple of this, or at 4 times this.
+min_chunk_lines = 2000
+
+
+class Fragment:
+    def __init__(self):
+        self.bytecode = bytes()
+        self.label_map: dict[str, int] = dict()
+        self.label_lines: dict[str, int] = dict()
+        self.label_list: list[tuple[str, int]] = list()
+        self.line_table: list[tuple[int, int]] = list()
+        # offset of the chunk's first instruction, None if it has none
+        self.code_start: int | None = None
+        # line of the first directive before any instruction in the chunk
+        self.first_directive: int | None = None
+        # line the chunk failed on
+        self.error_line: int | None = None
+
+
+def split_chunks(lines: list[str]) -> list[tuple[int, list[str]]]:
+    # (first line number, lines) for each chunk
+    chunks = []
+    start = 0
+    for index, line in enumerate(lines):
+        length = index + 1 - start
+        if length >= 4 * min_chunk_lines or \
+                (length >= min_chunk_lines and zlib.crc32(line.encode()) % min_chunk_lines == 0):
+            chunks.append((start + 1, lines[start:index + 1]))
+            start = index + 1
+    if start < len(lines):
+        chunks.append((start + 1, lines[start:]))
+    return chunks
+
+
+def assemble_chunk(lines: list[str]) -> Fragment:
+    # line numbers count from 1 at the start of the chunk
+    asm_state = AsmState()
+    fragment = Fragment()
+
+    # AsmState starts with the 4 byte entry address, which isn't part of the chunk
+    header = len(asm_state.bytecode)
+    try:
+        for line_num, line in enumerate(lines, start=1):
+            asm_line = AsmLine(line[0:-1], line_num)
+            line_address = len(asm_state.bytecode)
+
+            # directives are only accepted in the data stage
+            if assemble_line(asm_state, asm_line) and fragment.first_directive is None:
+                fragment.first_directive = line_num
+
+            if len(asm_state.bytecode) != line_address:
+                fragment.line_table.append((line_address - header, line_num))
+    except AssemblerError as e:
+        fragment.error_line = e.lineNum
+
+    fragment.bytecode = bytes(asm_state.bytecode[header:])
+    fragment.label_map = {label: address - header for label, address in asm_state.label_map.items()}
+    fragment.label_lines = asm_state.label_lines
+    fragment.label_list = [(marker.label, marker.location - header) for marker in asm_state.label_list]
+    if asm_state.code_start is not None:
+        fragment.code_start = asm_state.code_start - header
+    return fragment
+
+
+def link(fragments: list[tuple[int, Fragment]]) -> AsmState:
+    # (first line number, fragment) for each chunk
+    errors = []
+    seen_code = False
+    for first_line, fragment in fragments:
+        if fragment.error_line is not None:
+            errors.append(first_line - 1 + fragment.error_line)
+        # a directive after code that was in an earlier chunk
+        if seen_code and fragment.first_directive is not None:
+            errors.append(first_line - 1 + fragment.first_directive)
+        seen_code = seen_code or fragment.code_start is not None
+    if errors:
+        raise AssemblerError(min(errors))
+
+    asm_state = AsmState()
+    for first_line, fragment in fragments:
+        base = len(asm_state.bytecode)
+        line_base = first_line - 1
+        asm_state.bytecode.extend(fragment.bytecode)
+        for label, address in fragment.label_map.items():
+            asm_state.label_map[label] = base + address
+        for label, line in fragment.label_lines.items():
+            asm_state.label_lines[label] = line_base + line
+        asm_state.label_list.extend(LabelMarker(label, base + location) for label, location in fragment.label_list)
+        asm_state.line_table.extend((base + address, line_base + line) for address, line in fragment.line_table)
+
+        if asm_state.code_start is None and fragment.code_start is not None:
+            asm_state.code_start = base + fragment.code_start
+            asm_state.stage = Stage.Code
+            asm_state.bytecode[0:4] = asm_state.code_start.to_bytes(4, byteorder="little", signed=False)
+    return asm_state
+
+
+def assemble_parallel(lines: list[str], jobs: int, cache=None) -> AsmState:
+    # `cache` has get(lines) -> Fragment | None and put(lines, fragment)
+    chunks = split_chunks(lines)
+    fragments: list[Fragment | None] = [None] * len(chunks)
+    if cache is not None:
+        fragments = [cache.get(chunk_lines) for first_line, chunk_lines in chunks]
+
+    missing = [index for index, fragment in enumerate(fragments) if fragment is None]
+    work = [chunks[index][1] for index in missing]
+    if jobs <= 1 or len(work) <= 1:
+        assembled = [assemble_chunk(chunk_lines) for chunk_lines in work]
+    else:
+        # fork so the workers don't re-run the asm4380.py script
+        with multiprocessing.get_context("fork").Pool(jobs) as pool:
+            assembled = pool.map(assemble_chunk, work)
+
+    for index, fragment in zip(missing, assembled):
+        fragments[index] = fragment
+        if cache is not None and fragment.error_line is None:
+            cache.put(chunks[index][1], fragment)
+    return link([(chunk[0], fragment) for chunk, fragment in zip(chunks, fragments)])
@@ -5,7 +5,13 @@
 # Instruction | Directive to LineEnd
 #
 # All of them can transition to Error
-from plist import Data
+#
+# The states hold no data, so each has one shared instance. assemble_line
+# first tries the lexer (see lexer.py), which splits a well formed line into
+# tokens with one regular expression, and only runs the states character by
+# character for the lines it doesn't match. Both go through the same emit_*
+# functions.
+from __future__ import annotations
 
 # TODO:
 #  - [*] Write tests for optional Directive Operands
@@ -14,6 +20,7 @@ from plist import Data
 #  - [ ] Test error handling
 
 from asm_types import AsmState, AsmLine, AssemblerError, Stage, OperandType, LabelMarker
+from lexer import ESCAPE, lex
 
 
 def skip_space_tab(line: AsmLine, allow_line_end = False):
@@ -98,34 +105,99 @@ def parse_char(line: AsmLine) -> int:
 
     return char_byte
 
-def handle_immediate(asm_state: AsmState, line: AsmLine):
+def parse_string(line: AsmLine) -> bytearray:
+    if line.line[line.index] != "\"":
+        raise AssemblerError(line.line_num)
+    increment_index(line)
+
+    string_bytes = bytearray()
+    while line.line[line.index] != "\"":
+        # character to byte
+        if line.line[line.index] == "\\":
+            increment_index(line)
+            if not line.line[line.index] in escape_chars:
+                raise AssemblerError(line.line_num)
+            string_bytes.append(ord(escape_chars[line.line[line.index]]))
+        else:
+            char_byte = ord(line.line[line.index])
+            if char_byte < 0 or char_byte > 255:
+                raise AssemblerError(line.line_num)
+            string_bytes.append(char_byte)
+        increment_index(line)
+
+    increment_index(line, allow_eol=True)
+    return string_bytes
+
+def parse_immediate(line: AsmLine) -> int | str:
+    # a number or character's value, or a label's name
     if line.line[line.index] == "#":
-        numeric = parse_numeric(line)
-        num_bytes = numeric.to_bytes(4, byteorder="little", signed=True)
-        for i in range(4):
-            asm_state.bytecode.append(num_bytes[i])
+        return parse_numeric(line)
     elif line.line[line.index] == "'":
-        char_byte = parse_char(line)
-        asm_state.bytecode.append(char_byte)
-        for i in range(3):
-            asm_state.bytecode.append(0)
+        return parse_char(line)
+    return parse_label_name(line)
+
+def emit_immediate(asm_state: AsmState, immediate: int | str):
+    if isinstance(immediate, int):
+        asm_state.bytecode.extend(immediate.to_bytes(4, byteorder="little", signed=True))
     else:
-        label = parse_label_name(line)
-        label_marker = LabelMarker(label, len(asm_state.bytecode))
+        label_marker = LabelMarker(immediate, len(asm_state.bytecode))
         asm_state.label_list.append(label_marker)
 
         # add placeholder bytes
-        for i in range(4):
+        asm_state.bytecode.extend(bytes(4))
+
+def emit_instruction(asm_state: AsmState, instruction: str, registers: list[str], immediate: int | str | None):
+    # store binary representation of the instruction
+    asm_state.bytecode.append(bin_rep[instruction])
+
+    # convert operands into their binary representations
+    registers = iter(registers)
+    for operand in inst_operands[instruction][0:4]:
+        # emit zeros for don't care positions
+        if operand == OperandType.DC:
             asm_state.bytecode.append(0)
+        elif operand == OperandType.DC_I:
+            asm_state.bytecode.extend(bytes(4))
+        elif operand == OperandType.Register:
+            asm_state.bytecode.append(bin_rep[next(registers)])
+        elif operand == OperandType.Immediate:
+            emit_immediate(asm_state, immediate)
+        elif operand == OperandType.TrapCode:
+            asm_state.bytecode.extend(trap_codes[instruction].to_bytes(4, byteorder="little", signed=False))
+
+def emit_directive(asm_state: AsmState, dir_type: str, value: int | bytes | None, line_num: int):
+    # value is None for a missing operand. Unknown directives emit nothing.
+    if dir_type == "INT":
+        integer = 0 if value is None else value
+        # out of range
+        if integer < -2147483648 or integer > 2147483647:
+            raise AssemblerError(line_num)
+        asm_state.bytecode.extend(integer.to_bytes(4, byteorder="little", signed=True))
+    elif dir_type == "BYT":
+        integer = 0 if value is None else value
+        # out of range
+        if integer < 0 or integer > 255:
+            raise AssemblerError(line_num)
+        asm_state.bytecode.append(integer)
+    elif dir_type == "STR":
+        # length byte followed by the characters
+        if len(value) > 255:
+            raise AssemblerError(line_num)
+        asm_state.bytecode.append(len(value))
+        asm_state.bytecode.extend(value)
+
+def define_label(asm_state: AsmState, label_name: str, line_num: int):
+    # store the location of this label
+    asm_state.label_map[label_name] = len(asm_state.bytecode)
+    asm_state.label_lines[label_name] = line_num
 
 def switch_to_code_stage(asm_state: AsmState):
     asm_state.stage = Stage.Code
 
     # write address to first 4 bytes
     inst_addr = len(asm_state.bytecode)
-    addr_bytes = inst_addr.to_bytes(4, byteorder="little", signed=False);
-    for i in range(4):
-        asm_state.bytecode[i] = addr_bytes[i]
+    asm_state.code_start = inst_addr
+    asm_state.bytecode[0:4] = inst_addr.to_bytes(4, byteorder="little", signed=False)
 
 def increment_index(line: AsmLine, allow_eol=False):
     line.index += 1
@@ -139,6 +211,8 @@ reg3 = [OperandType.Register, OperandType.Register, OperandType.Register, Operan
 reg1_immed = [OperandType.Register, OperandType.DC, OperandType.DC, OperandType.Immediate, 1]
 reg2_immed = [OperandType.Register, OperandType.Register, OperandType.DC, OperandType.Immediate, 2]
 immed = [OperandType.DC, OperandType.DC, OperandType.DC, OperandType.Immediate, 0]
+# named traps, assembled as TRP with the code from trap_codes
+trap_alias = [OperandType.DC, OperandType.DC, OperandType.DC, OperandType.TrapCode, 0]
 inst_operands = {
     "JMP": immed,
     "MOV": reg2,
@@ -157,9 +231,22 @@ inst_operands = {
     "DIV": reg3,
     "SDIV": reg3,
     "DIVI": reg2_immed,
-    "TRP": immed
+    "TRP": immed,
+    "CAS": reg2_immed,
+    "FAA": reg2_immed,
+    "MEMCPY": trap_alias,
+    "MEMSET": trap_alias,
+    "MEMCMP": trap_alias,
+    "PUTS": trap_alias,
+    "ALLOC": trap_alias,
+    "FREE": trap_alias
 }
 
+# block memory traps: copy/fill/compare R5 bytes at R3 (and R4)
+# PUTS: print the .STR string at R3
+# ALLOC/FREE: allocate R3 bytes / free the block at R3 on the heap
+trap_codes = {"MEMCPY": 102, "MEMSET": 103, "MEMCMP": 104, "PUTS": 105, "ALLOC": 106, "FREE": 107}
+
 valid_registers = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9", "R10", "R11", "R12", "R13", "R14", "R15",
                    "PC", "SL", "SB", "SP", "FP", "HP"}
 
@@ -168,6 +255,7 @@ bin_rep = {
     # instructions
     "JMP": 1, "MOV": 7, "MOVI": 8, "LDA": 9, "STR": 10, "LDR": 11, "STB": 12, "LDB": 13, "ADD": 18, "ADDI": 19,
     "SUB": 20, "SUBI": 21, "MUL": 22, "MULI": 23, "DIV": 24, "SDIV": 25, "DIVI": 26, "TRP": 31,
+    "CAS": 40, "FAA": 41, "MEMCPY": 31, "MEMSET": 31, "MEMCMP": 31, "PUTS": 31, "ALLOC": 31, "FREE": 31,
     # registers
     "R0": 0, "R1": 1, "R2": 2, "R3": 3, "R4": 4, "R5": 5, "R6": 6, "R7": 7, "R8": 8, "R9": 9, "R10": 10, "R11": 11,
     "R12": 12, "R13": 13, "R14": 14, "R15": 15, "PC": 16, "SL": 17, "SB": 18, "SP": 19, "FP": 20, "HP": 21
@@ -185,11 +273,11 @@ class LineStart(State):
 
         # check for empty or comment line
         if len(line.line) == 0 or line.line[line.index] == ";":
-            return LineEnd()
+            return line_end_state
 
         # check for label
         if line.line[line.index].isalnum():
-            return Label()
+            return label_state
 
         # throw error for non space or tab character
         if not (line.line[line.index] == " " or line.line[line.index] == "\t"):
@@ -200,19 +288,19 @@ class LineStart(State):
 
         # comment or end of line, so end the line
         if line.index >= len(line.line) or line.line[line.index] == ";":
-            return LineEnd()
+            return line_end_state
         # alphabetic, so instruction
         if line.line[line.index].isalpha():
             # switch to Code stage if necessary
             if asm_state.stage == Stage.Data:
                 switch_to_code_stage(asm_state)
-            return Instruction()
+            return instruction_state
         # period, so directive
         if line.line[line.index] == ".":
             # Directives only allowed in the data stage
             if asm_state.stage != Stage.Data:
                 raise AssemblerError(line.line_num)
-            return Directive()
+            return directive_state
 
         # no valid character found so raise an error
         raise AssemblerError(line.line_num)
@@ -223,49 +311,43 @@ class Instruction(State):
 
         # invalid instruction found
         if not instruction in inst_operands:
-            return Error()
+            return error_state
 
-        skip_space_tab(line)
-
-        # store binary representation of the instruction
-        asm_state.bytecode.append(bin_rep[instruction])
+        # named traps take no operands, so the line may end here
+        skip_space_tab(line, allow_line_end=inst_operands[instruction] is trap_alias)
 
-        # convert operands into their binary representations
+        registers = []
+        immediate = None
+        num_commas = inst_operands[instruction][4]
         for i in range(4):
             operand = inst_operands[instruction][i]
-            num_commas = inst_operands[instruction][4]
-            # emit zeros for don't care positions
-            if operand == OperandType.DC:
-                asm_state.bytecode.append(0)
-            elif operand == OperandType.DC_I:
-                for j in range(4):
-                    asm_state.bytecode.append(0)
-            elif operand == OperandType.Register:
+            if operand == OperandType.Register:
                 skip_space_tab(line)
                 register = parse_alphanumeric(line).upper()
                 # error if invalid register
                 if not register in valid_registers:
-                    return Error()
-                asm_state.bytecode.append(bin_rep[register])
+                    return error_state
+                registers.append(register)
 
                 # check for comma and skip over it
                 if i < num_commas:
                     skip_space_tab(line)
                     if line.line[line.index] != ",":
-                        return Error()
+                        return error_state
                     increment_index(line)
 
             elif operand == OperandType.Immediate:
                 skip_space_tab(line)
-                handle_immediate(asm_state, line)
+                immediate = parse_immediate(line)
 
         # make sure there's nothing but whitespace and comments at the end of the line
         skip_space_tab(line, allow_line_end=True)
         if line.index < len(line.line) and line.line[line.index] != ";":
-            return Error()
+            return error_state
 
+        emit_instruction(asm_state, instruction, registers, immediate)
         # end the line
-        return LineEnd()
+        return line_end_state
 
 class Directive(State):
     def run(self, asm_state: AsmState, line: AsmLine):
@@ -275,59 +357,41 @@ class Directive(State):
         dir_type = parse_alpha(line).upper()
 
         skip_space_tab(line, allow_line_end=True)
+        # missing operand
+        at_end = line.index >= len(line.line) or line.line[line.index] == ";"
+        value = None
         if dir_type == "INT":
-            integer = 0
-            # check for missing operand
-            if line.index < len(line.line) and line.line[line.index] != ";":
+            if not at_end:
                 if line.line[line.index] != "#":
-                    return Error()
-                integer = parse_numeric(line)
-
-            # out of range
-            if integer < -2147483648 or integer > 2147483647:
-                return Error()
-            # store bytes
-            int_bytes = integer.to_bytes(4, byteorder="little", signed=True)
-            for i in range(4):
-                asm_state.bytecode.append(int_bytes[i])
+                    return error_state
+                value = parse_numeric(line)
         elif dir_type == "BYT":
-            # check for missing operand
-            if line.index >= len(line.line) or line.line[line.index] == ";":
-                asm_state.bytecode.append(0);
-                return LineEnd()
-
-            if line.line[line.index] != "#" and line.line[line.index] != "'":
-                return Error()
-
-            if line.line[line.index] == "#":
-                integer = parse_numeric(line)
-                # out of range
-                if integer < 0 or integer > 255:
-                    return Error()
-                # store bytes
-                int_byte = integer.to_bytes(1)
-                asm_state.bytecode.append(int_byte[0])
-            elif line.line[line.index] == "'":
-                char_byte = parse_char(line)
-                asm_state.bytecode.append(char_byte)
-
+            if not at_end:
+                if line.line[line.index] == "#":
+                    value = parse_numeric(line)
+                elif line.line[line.index] == "'":
+                    value = parse_char(line)
+                else:
+                    return error_state
+        elif dir_type == "STR":
+            if at_end or line.line[line.index] != "\"":
+                return error_state
+            value = bytes(parse_string(line))
 
         # make sure there's nothing but whitespace and comments at the end of the line
         skip_space_tab(line, allow_line_end=True)
         if line.index < len(line.line) and line.line[line.index] != ";":
-            return Error()
+            return error_state
 
-        return LineEnd()
+        emit_directive(asm_state, dir_type, value, line.line_num)
+        return line_end_state
 
 
 
 
 class Label(State):
     def run(self, asm_state: AsmState, line: AsmLine):
-        label_name = parse_label_name(line)
-
-        # store the location of this label
-        asm_state.label_map[label_name] = len(asm_state.bytecode)
+        define_label(asm_state, parse_label_name(line), line.line_num)
 
         skip_space_tab(line)
 
@@ -335,11 +399,11 @@ class Label(State):
         if line.line[line.index] == ".":
             if asm_state.stage != Stage.Data:
                 raise AssemblerError(line.line_num)
-            return Directive()
+            return directive_state
         if line.line[line.index].isalpha():
             if asm_state.stage == Stage.Data:
                 switch_to_code_stage(asm_state)
-            return Instruction()
+            return instruction_state
 
         # didn't find a valid character so raise an error
         raise AssemblerError(line.line_num)
@@ -350,3 +414,88 @@ class LineEnd(State):
 class Error(State):
     def run(self, asm_state: AsmState, line: AsmLine) -> State:
         raise AssemblerError(line.line_num)
+
+line_start_state = LineStart()
+label_state = Label()
+instruction_state = Instruction()
+directive_state = Directive()
+line_end_state = LineEnd()
+error_state = Error()
+
+
+# directive operands the lexer path handles, by first character (None for
+# a missing operand). Others, and unknown directives, go through the states.
+lexed_directives = {("INT", None), ("INT", "#"), ("BYT", None), ("BYT", "#"), ("BYT", "'"), ("STR", "\"")}
+
+def unescape(text: str) -> str:
+    return ESCAPE.sub(lambda match: escape_chars[match[1]], text)
+
+def token_value(token: str) -> int | bytes | str:
+    # number, char and label tokens to immediates, string tokens to bytes
+    if token[0] == "#":
+        return int(token[1:])
+    if token[0] == "'":
+        return ord(unescape(token[1:-1]))
+    if token[0] == "\"":
+        return unescape(token[1:-1]).encode("latin-1")
+    return token
+
+def assemble_tokens(asm_state: AsmState, line: AsmLine) -> bool | None:
+    # assembles a line the lexer matched, None if it has to go through the
+    # states instead. Nothing is changed before that is known.
+    tokens = lex(line.line)
+    if tokens is None:
+        return None
+    label, directive, operation = tokens.group("label", "directive", "operation")
+    if directive is None and operation is None:
+        # a label on its own is an error the states report, as is a line of
+        # one space or tab
+        return None if label is not None or len(line.line) == 1 else False
+
+    if directive is not None:
+        dir_type = directive.upper()
+        value = tokens["value"]
+        if (dir_type, value[0] if value else None) not in lexed_directives:
+            return None
+        if asm_state.stage != Stage.Data:
+            raise AssemblerError(line.line_num)
+        if label is not None:
+            define_label(asm_state, label, line.line_num)
+        emit_directive(asm_state, dir_type, None if value is None else token_value(value), line.line_num)
+        return True
+
+    instruction = operation.upper()
+    form = inst_operands.get(instruction)
+    if form is None:
+        return None
+    registers = [register.upper() for register in tokens.group("reg1", "reg2", "reg3") if register is not None]
+    last = tokens["last"]
+    immediate = None
+    if OperandType.Immediate in form:
+        if last is None:
+            return None
+        immediate = token_value(last)
+    elif last is not None:
+        registers.append(last.upper())
+    if len(registers) != form.count(OperandType.Register) or not all(r in valid_registers for r in registers):
+        return None
+
+    if label is not None:
+        define_label(asm_state, label, line.line_num)
+    if asm_state.stage == Stage.Data:
+        switch_to_code_stage(asm_state)
+    emit_instruction(asm_state, instruction, registers, immediate)
+    return False
+
+def assemble_line(asm_state: AsmState, line: AsmLine) -> bool:
+    # returns whether the line holds a directive
+    directive = assemble_tokens(asm_state, line)
+    if directive is not None:
+        return directive
+
+    directive = False
+    state = line_start_state
+    while state is not line_end_state:
+        state = state.run(asm_state, line)
+        directive = directive or state is directive_state
+    return directive
@@ -0,0 +1,105 @@
+# Streaming mode: stand-ins for AsmState's bytecode, label_list and line_table
+# that keep memory bounded by the symbol table instead of the output size.
+#
+# StreamingBytecode writes the output file as it is produced and only keeps a
+# small buffer, so label placeholders are patched by seeking back into the
+# file. Label markers and line records are spilled to temporary files and
+# read back in the order they were added, which is increasing address order,
+# so patching is a single forward pass over the output.
+import struct
+import tempfile
+from typing import BinaryIO, Iterator
+
+from asm_types import LabelMarker
+
+
+class StreamingBytecode:
+    def __init__(self, out_file: BinaryIO, buffer_size: int = 1 << 20):
+        self.file = out_file
+        self.buffer = bytearray()
+        self.buffer_size = buffer_size
+        # bytes already written to the file
+        self.flushed = 0
+
+    def __len__(self) -> int:
+        return self.flushed + len(self.buffer)
+
+    def append(self, byte: int):
+        self.buffer.append(byte)
+        if len(self.buffer) >= self.buffer_size:
+            self.flush()
+
+    def extend(self, data):
+        self.buffer.extend(data)
+        if len(self.buffer) >= self.buffer_size:
+            self.flush()
+
+    def __setitem__(self, index: slice, data: bytes):
+        # only slices are supported, which is how placeholders are patched
+        start = index.start
+        if start >= self.flushed:
+            self.buffer[start - self.flushed:start - self.flushed + len(data)] = data
+            return
+
+        self.file.seek(start)
+        self.file.write(data[:self.flushed - start])
+        self.file.seek(self.flushed)
+        if start + len(data) > self.flushed:
+            self.buffer[0:start + len(data) - self.flushed] = data[self.flushed - start:]
+
+    def flush(self):
+        self.file.write(self.buffer)
+        self.flushed += len(self.buffer)
+        self.buffer.clear()
+
+
+# an append-only list of fixed-size integer records kept in a temporary file
+class SpillList:
+    def __init__(self, record_format: str):
+        self.record = struct.Struct(record_format)
+        self.file = tempfile.TemporaryFile()
+        self.buffer = bytearray()
+        self.count = 0
+
+    def __len__(self) -> int:
+        return self.count
+
+    def append(self, record: tuple):
+        self.buffer.extend(self.record.pack(*record))
+        self.count += 1
+        if len(self.buffer) >= 1 << 16:
+            self.file.write(self.buffer)
+            self.buffer.clear()
+
+    def __iter__(self) -> Iterator[tuple]:
+        self.file.write(self.buffer)
+        self.buffer.clear()
+        self.file.seek(0)
+
+        chunk_size = self.record.size * 4096
+        while chunk := self.file.read(chunk_size):
+            yield from self.record.iter_unpack(chunk)
+        self.file.seek(0, 2)
+
+
+# label_list replacement storing (location, label id) records
+class SpilledLabelMarkers:
+    def __init__(self):
+        self.records = SpillList("<QI")
+        self.label_ids: dict[str, int] = dict()
+        self.labels: list[str] = list()
+
+    def __len__(self) -> int:
+        return len(self.records)
+
+    def append(self, marker: LabelMarker):
+        label_id = self.label_ids.get(marker.label)
+        if label_id is None:
+            label_id = len(self.labels)
+            self.label_ids[marker.label] = label_id
+            self.labels.append(marker.label)
+        self.records.append((marker.location, label_id))
+
+    def __iter__(self) -> Iterator[LabelMarker]:
+        for location, label_id in self.records:
+            yield LabelMarker(self.labels[label_id], location)
@@ -1,16 +1,27 @@
 import filecmp
 import os
+import struct
 import subprocess
+import sys
 from subprocess import CompletedProcess
 
 from os import listdir
 import pytest
 
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+from asm4380 import assemble_file
+from asm_types import AssemblerError
+from bin_format import fnv1a_64, fnv1a_64_bytes, FNV_OFFSET
+
 # These are system tests. Each test follows a similar set of instructions.
 # 1. The assembler is called with a .asm file
 # 2. The return code of the assembler validated
 # 3. The output binary file is checked against a handcrafted binary file to check assembler behavior
 #
+# Tests of the assembler's output and error lines call it in process through
+# assemble_file. Tests of the command line (flags, exit codes, output files)
+# run asm4380.py.
+#
 # The input directory contains the .asm files and is also where the assembler will place the
 # output binaries as per the project 2 spec.
 #
@@ -27,18 +38,16 @@ assembler_path = "../asm4380.py"
 def cmp_output_expected(input_name: str) -> bool:
     return filecmp.cmp(expected_dir + input_name + ".bin", input_dir + input_name + ".bin", shallow=False)
 
-def run_assembler(input_name: str, err_input = False) -> CompletedProcess:
+def run_assembler(input_name: str, err_input = False, flags: list[str] = []) -> CompletedProcess:
     if err_input:
-        args = ["python", assembler_path, input_err_dir + input_name + ".asm"]
+        args = ["python", assembler_path] + flags + [input_err_dir + input_name + ".asm"]
     else:
-        args = ["python", assembler_path, input_dir + input_name + ".asm"]
+        args = ["python", assembler_path] + flags + [input_dir + input_name + ".asm"]
     return subprocess.run(args, capture_output=True, text=True)
 
 def run_and_cmp(file_pair_prefix: str):
-    result = run_assembler(file_pair_prefix)
-
-    assert result.returncode == 0
-    assert cmp_output_expected(file_pair_prefix)
+    with open(expected_dir + file_pair_prefix + ".bin", "rb") as expected:
+        assert assemble_file(input_dir + file_pair_prefix + ".asm") == expected.read()
 
 @pytest.mark.parametrize(
     ["input_err", "line_failure",],
@@ -60,9 +69,15 @@ def run_and_cmp(file_pair_prefix: str):
     ],
 )
 def test_asm_error_handling(input_err: str, line_failure: int):
-    result = run_assembler(input_err, True)
+    with pytest.raises(AssemblerError) as error:
+        assemble_file(input_err_dir + input_err + ".asm")
+
+    assert error.value.lineNum == line_failure
+
+def test_asm_error_exit_code():
+    result = run_assembler("invalid_instruction", True)
 
-    assert result.stdout == "Assembler error encountered on line " + str(line_failure) + "!\n"
+    assert result.stdout == "Assembler error encountered on line 3!\n"
     assert result.returncode == 2
 
 def test_no_input_file_provided():
@@ -102,6 +117,150 @@ def test_directive_variations():
 def test_instructions():
     run_and_cmp("instructions")
 
+def test_symbols_file():
+    result = run_assembler("jmp_to_lbl", flags=["--symbols"])
+
+    assert result.returncode == 0
+    assert cmp_output_expected("jmp_to_lbl")
+    with open(input_dir + "jmp_to_lbl.sym") as sym_file:
+        assert sym_file.read() == ("# asm4380 symbols v1\n"
+                                   "label 20 3 EXIT\n"
+                                   "line 4 1\n"
+                                   "line 12 2\n"
+                                   "line 20 3\n")
+
+def test_unknown_flag():
+    result = run_assembler("jmp_to_lbl", flags=["--bogus"])
+
+    assert result.returncode == 1
+
+def test_v2_binary_matches_v1_memory():
+    result = run_assembler("given_example", flags=["--v2"])
+    assert result.returncode == 0
+
+    with open(input_dir + "given_example.bin", "rb") as v2_file:
+        v2 = v2_file.read()
+    with open(expected_dir + "given_example.bin", "rb") as v1_file:
+        v1 = v1_file.read()
+
+    (magic, version, header_size, entry, data_offset, data_address, data_size, bss_size,
+     code_offset, code_address, code_size) = struct.unpack("<4sHHIIIIIIII", v2[0:40])
+    assert (magic, version, header_size) == (b"4380", 2, 48)
+
+    # rebuild the version 1 memory image from the segments
+    memory = bytearray(code_address + code_size)
+    memory[0:4] = entry.to_bytes(4, byteorder="little")
+    memory[data_address:data_address + data_size] = v2[data_offset:data_offset + data_size]
+    memory[code_address:code_address + code_size] = v2[code_offset:code_offset + code_size]
+    assert bytes(memory) == v1
+
+def test_v2_zero_data_is_not_stored():
+    result = run_assembler("directive_variations", flags=["--v2"])
+    assert result.returncode == 0
+
+    with open(input_dir + "directive_variations.bin", "rb") as v2_file:
+        v2 = v2_file.read()
+    with open(expected_dir + "directive_variations.bin", "rb") as v1_file:
+        v1 = v1_file.read()
+
+    data_size, bss_size = struct.unpack("<II", v2[20:28])
+    code_address = struct.unpack("<I", v2[32:36])[0]
+    data = v1[4:code_address]
+    assert bss_size > 0
+    assert bss_size == len(data) - len(data.rstrip(b"\0"))
+    assert data_size + bss_size == len(data)
+
+def test_v2_hash_skips_zero_runs_correctly():
+    data = b"\x01" + bytes(63) + b"\x02" + bytes(64) + b"\x03\x00" + bytes(1000)
+    assert fnv1a_64(data) == fnv1a_64_bytes(data, FNV_OFFSET)
+
+def test_optimize_drops_jump_to_next_instruction():
+    result = run_assembler("given_example", flags=["--optimize"])
+    assert result.returncode == 0
+
+    with open(input_dir + "given_example.bin", "rb") as optimized_file:
+        optimized = optimized_file.read()
+    with open(expected_dir + "given_example.bin", "rb") as expected_file:
+        expected = expected_file.read()
+
+    # "jmp MAIN" is the first instruction and MAIN the second
+    code_start = int.from_bytes(expected[0:4], byteorder="little")
+    assert optimized == expected[:code_start] + expected[code_start + 8:]
+
+def test_stream_matches_in_memory_output():
+    for input_name in ["given_example", "directive_variations", "instructions", "jmp_to_lbl"]:
+        result = run_assembler(input_name, flags=["--stream"])
+        assert result.returncode == 0
+        assert cmp_output_expected(input_name)
+
+def test_stream_rejects_whole_program_flags():
+    for flag in ["--v2", "--optimize"]:
+        result = run_assembler("given_example", flags=["--stream", flag])
+        assert result.returncode == 1
+        assert result.stdout.startswith("USAGE:")
+
+def test_stream_removes_partial_output_on_error():
+    result = run_assembler("missing_label", err_input=True, flags=["--stream"])
+    assert result.returncode == 2
+    assert not os.path.exists(input_err_dir + "missing_label.bin")
+
+def test_parallel_matches_serial_output():
+    for input_name in ["given_example", "directive_variations", "instructions"]:
+        result = run_assembler(input_name, flags=["--parallel=2"])
+        assert result.returncode == 0
+        assert cmp_output_expected(input_name)
+
+    result = run_assembler("missing_label", err_input=True, flags=["--parallel"])
+    assert result.returncode == 2
+    assert result.stdout == "Assembler error encountered on line 49!\n"
+
+def test_parallel_invalid_job_count():
+    for flag in ["--parallel=0", "--parallel=x", "--parallelx"]:
+        result = run_assembler("given_example", flags=[flag])
+        assert result.returncode == 1
+
+def test_cache_reuses_outputs(tmp_path):
+    cache_flag = "--cache=" + str(tmp_path)
+    for _ in range(2):
+        result = run_assembler("given_example", flags=[cache_flag, "--symbols"])
+        assert result.returncode == 0
+        assert cmp_output_expected("given_example")
+    assert len(listdir(tmp_path / "outputs")) == 2
+
+    # the flags are part of the key
+    result = run_assembler("given_example", flags=[cache_flag])
+    assert result.returncode == 0
+    assert len(listdir(tmp_path / "outputs")) == 3
+
+    result = run_assembler("missing_label", err_input=True, flags=[cache_flag])
+    assert result.returncode == 2
+    assert result.stdout == "Assembler error encountered on line 49!\n"
+
+    result = run_assembler("given_example", flags=[cache_flag, "--stream"])
+    assert result.returncode == 1
+
+def test_stream_ignores_cache_environment(tmp_path):
+    args = ["python", assembler_path, "--stream", input_dir + "given_example.asm"]
+    result = subprocess.run(args, capture_output=True, text=True,
+                            env=dict(os.environ, ASM4380_CACHE=str(tmp_path)))
+    assert result.returncode == 0
+    assert cmp_output_expected("given_example")
+    assert listdir(tmp_path) == []
+
+def test_pipe_writes_framed_binary_to_stdout():
+    with open(input_dir + "given_example.asm") as source:
+        result = subprocess.run(["python", assembler_path, "-"], stdin=source, capture_output=True)
+    with open(expected_dir + "given_example.bin", "rb") as expected:
+        binary = expected.read()
+    assert result.returncode == 0
+    assert result.stdout == struct.pack("<I", len(binary)) + binary
+
+    # errors go to stderr, stdout only ever holds the binary
+    result = subprocess.run(["python", assembler_path, "-"], input="  bad r1\n", capture_output=True, text=True)
+    assert result.returncode == 2
+    assert result.stdout == ""
+    assert result.stderr == "Assembler error encountered on line 1!\n"
+
 # session fixture that deletes all the assembler binary files after the tests run
 @pytest.fixture(scope="session", autouse=True)
 def clean_binary_outputs():
@@ -109,5 +268,5 @@ def clean_binary_outputs():
     yield
     # clean up files after test run
     for file_name in listdir(input_dir):
-        if file_name.endswith(".bin"):
+        if file_name.endswith(".bin") or file_name.endswith(".sym"):
             os.remove(input_dir + file_name)
@@ -0,0 +1,46 @@
+import io
+
+import pytest
+
+from asm4380 import assemble, assemble_file
+from asm_types import AssemblerError
+from bin_format import to_v2
+
+source = """X .INT #5
+MAIN ldr r3, X
+  trp #1
+  trp #0"""
+
+expected = (8).to_bytes(4, byteorder="little") + (5).to_bytes(4, byteorder="little") + \
+           bytes([11, 3, 0, 0, 4, 0, 0, 0, 31, 0, 0, 0, 1, 0, 0, 0, 31, 0, 0, 0, 0, 0, 0, 0])
+
+def test_assembles_string_and_file_objects():
+    # the last line has no newline
+    assert assemble(source) == expected
+    assert assemble(io.StringIO(source + "\n")) == expected
+
+def test_assemble_file(tmp_path):
+    path = tmp_path / "program.asm"
+    path.write_text(source)
+    assert assemble_file(str(path)) == expected
+    assert not (tmp_path / "program.bin").exists()
+
+def test_options_match_command_line():
+    assert assemble(source, v2=True) == to_v2(expected, 8)
+    assert assemble(source, jobs=2) == expected
+    assert assemble("  movi r1, #1\n  addi r1, r1, #0\n  trp #0\n", optimize=True) == \
+           assemble("  movi r1, #1\n  trp #0\n")
+
+def test_errors_raise_with_line_number():
+    with pytest.raises(AssemblerError) as error:
+        assemble(source.replace("ldr r3, X", "ldr r3, Y"))
+    # a missing label is reported on the last line
+    assert error.value.lineNum == 4
+
+    with pytest.raises(AssemblerError) as error:
+        assemble("X .INT #1\n  bad r1\n")
+    assert error.value.lineNum == 2
+
+def test_many_programs_in_one_process():
+    for value in range(200):
+        assert assemble(f"X .INT #{value}\n  trp #0\n")[4:8] == value.to_bytes(4, byteorder="little")
@@ -0,0 +1,89 @@
+import pytest
+
+import parallel
+from cache import AssemblyCache
+from parallel import assemble_parallel, split_chunks
+
+
+class CountingCache(AssemblyCache):
+    def __init__(self, cache_dir: str):
+        super().__init__(cache_dir)
+        self.hits = 0
+        self.puts = 0
+
+    def get(self, lines):
+        fragment = super().get(lines)
+        self.hits += fragment is not None
+        return fragment
+
+    def put(self, lines, fragment):
+        self.puts += 1
+        super().put(lines, fragment)
+
+
+def program(data_lines: int, code_lines: int) -> list[str]:
+    lines = [f"D{i} .INT #{i}\n" for i in range(data_lines)]
+    lines += ["MAIN ldr r1, D0\n"]
+    lines += [f"L{i} addi r1, r1, #{i}\n" for i in range(code_lines)]
+    lines += ["  jmp MAIN\n"]
+    return lines
+
+@pytest.fixture(autouse=True)
+def small_chunks(monkeypatch):
+    monkeypatch.setattr(parallel, "min_chunk_lines", 4)
+
+def test_unchanged_source_reuses_every_fragment(tmp_path):
+    lines = program(20, 40)
+    cache = CountingCache(str(tmp_path))
+    first = assemble_parallel(lines, 1, cache)
+    assert cache.hits == 0 and cache.puts == len(split_chunks(lines))
+
+    cache = CountingCache(str(tmp_path))
+    second = assemble_parallel(lines, 1, cache)
+    assert cache.hits == len(split_chunks(lines)) and cache.puts == 0
+    assert second.bytecode == first.bytecode
+    assert second.label_map == first.label_map
+    assert second.line_table == first.line_table
+
+def test_edit_only_reassembles_nearby_chunks(tmp_path):
+    lines = program(20, 40)
+    assemble_parallel(lines, 1, CountingCache(str(tmp_path)))
+
+    # inserting a line moves everything after it, which still comes from the cache
+    lines.insert(30, "  addi r2, r2, #7\n")
+    cache = CountingCache(str(tmp_path))
+    cached = assemble_parallel(lines, 1, cache)
+    assert cache.hits >= len(split_chunks(lines)) - 2
+    assert cache.puts <= 2
+
+    fresh = assemble_parallel(lines, 1, None)
+    assert cached.bytecode == fresh.bytecode
+    assert cached.label_map == fresh.label_map
+    assert cached.label_lines == fresh.label_lines
+    assert cached.line_table == fresh.line_table
+
+def test_failed_chunks_are_not_cached(tmp_path):
+    lines = program(4, 8)
+    lines[6] = "  bad r1\n"
+    cache = CountingCache(str(tmp_path))
+    with pytest.raises(Exception):
+        assemble_parallel(lines, 1, cache)
+    assert cache.puts == len(split_chunks(lines)) - 1
+
+def test_key_depends_on_version_and_parts(tmp_path):
+    cache = AssemblyCache(str(tmp_path))
+    assert cache.key(b"ab", b"c") != cache.key(b"a", b"bc")
+    assert cache.key(b"source", b"--v2") != cache.key(b"source", b"")
+
+    other = AssemblyCache(str(tmp_path))
+    other.version = b"another assembler"
+    assert other.key(b"source") != cache.key(b"source")
+
+def test_outputs_round_trip(tmp_path):
+    cache = AssemblyCache(str(tmp_path))
+    key = cache.key(b"source")
+    assert cache.get_outputs(key, [".bin"]) is None
+
+    cache.put_outputs(key, {".bin": b"\x01\x02", ".sym": b"MAIN 4\n"})
+    assert cache.get_outputs(key, [".bin", ".sym"]) == {".bin": b"\x01\x02", ".sym": b"MAIN 4\n"}
+    assert cache.get_outputs(key, [".bin", ".lst"]) is None
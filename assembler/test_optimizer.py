@@ -0,0 +1,125 @@
+from asm_types import AsmState, AsmLine
+from optimizer import optimize
+from states import LineStart, LineEnd
+
+
+def assemble(source: str) -> AsmState:
+    asm_state = AsmState()
+    for line_num, line in enumerate(source.strip("\n").split("\n"), start=1):
+        asm_line = AsmLine(line, line_num)
+        line_address = len(asm_state.bytecode)
+
+        state = LineStart()
+        while not type(state) is LineEnd:
+            state = state.run(asm_state, asm_line)
+
+        if len(asm_state.bytecode) != line_address:
+            asm_state.line_table.append((line_address, line_num))
+    return asm_state
+
+def code(asm_state: AsmState) -> list[tuple[int, int, int, int]]:
+    # (operation, operand 1, operand 2, immediate) per instruction
+    slots = []
+    for address in range(asm_state.code_start, len(asm_state.bytecode), 8):
+        slot = asm_state.bytecode[address:address + 8]
+        slots.append((slot[0], slot[1], slot[2], int.from_bytes(slot[4:8], byteorder="little")))
+    return slots
+
+def markers(asm_state: AsmState) -> dict[int, str]:
+    return {marker.location: marker.label for marker in asm_state.label_list}
+
+def test_removes_noops_and_relocates_labels():
+    asm_state = assemble("""
+X .INT #5
+MAIN mov r1, r1
+  addi r2, r2, #0
+LOOP muli r3, r3, #1
+  ldr r4, X
+  jmp LOOP
+""")
+    optimize(asm_state)
+
+    start = asm_state.code_start
+    assert code(asm_state) == [(11, 4, 0, 0), (1, 0, 0, 0)]
+    assert asm_state.label_map["X"] == 4
+    assert asm_state.label_map["MAIN"] == start
+    assert asm_state.label_map["LOOP"] == start
+    assert markers(asm_state) == {start + 4: "X", start + 12: "LOOP"}
+    assert asm_state.line_table == [(4, 1), (start, 5), (start + 8, 6)]
+
+def test_folds_constant_chains():
+    asm_state = assemble("""
+  movi r1, #10
+  addi r1, r1, #5
+  muli r1, r1, #3
+  subi r1, r1, #50
+  addi r2, r3, #4
+  subi r2, r2, #1
+  trp #0
+""")
+    optimize(asm_state)
+
+    assert code(asm_state) == [(8, 1, 0, 0xFFFFFFFB), (19, 2, 3, 3), (31, 0, 0, 0)]
+
+def test_fold_stops_at_referenced_label():
+    asm_state = assemble("""
+  movi r1, #10
+BACK addi r1, r1, #5
+  jmp BACK
+""")
+    optimize(asm_state)
+
+    assert code(asm_state) == [(8, 1, 0, 10), (19, 1, 1, 5), (1, 0, 0, 0)]
+
+def test_muli_strength_reduction():
+    asm_state = assemble("""
+  movi r1, #3
+  trp #2
+  muli r4, r3, #2
+  muli r5, r3, #0
+  muli r6, r3, #1
+  muli r7, r3, #8
+  trp #0
+""")
+    optimize(asm_state)
+
+    assert code(asm_state)[2:] == [(18, 4, 3, 0), (8, 5, 0, 0), (7, 6, 3, 0), (23, 7, 3, 8), (31, 0, 0, 0)]
+
+def test_threads_jumps_and_drops_jump_to_next():
+    asm_state = assemble("""
+  jmp A
+  trp #98
+A jmp B
+  trp #1
+B jmp C
+C trp #0
+""")
+    optimize(asm_state)
+
+    start = asm_state.code_start
+    assert code(asm_state) == [(1, 0, 0, 0), (31, 0, 0, 98), (1, 0, 0, 0), (31, 0, 0, 1), (31, 0, 0, 0)]
+    assert markers(asm_state) == {start + 4: "C", start + 20: "C"}
+    assert asm_state.label_map["A"] == start + 16
+    assert asm_state.label_map["B"] == start + 32
+    assert asm_state.label_map["C"] == start + 32
+
+def test_numeric_jump_keeps_layout():
+    asm_state = assemble("""
+  mov r1, r1
+  muli r2, r2, #2
+  jmp #12
+  trp #0
+""")
+    optimize(asm_state)
+
+    assert code(asm_state) == [(7, 1, 1, 0), (18, 2, 2, 0), (1, 0, 0, 12), (31, 0, 0, 0)]
+
+def test_write_to_pc_keeps_layout():
+    asm_state = assemble("""
+  movi pc, #20
+  addi r1, r1, #0
+  trp #0
+""")
+    optimize(asm_state)
+
+    assert len(code(asm_state)) == 3
@@ -0,0 +1,76 @@
+import pytest
+
+import parallel
+from asm_types import AsmState, AsmLine, AssemblerError
+from parallel import assemble_parallel
+from states import LineStart, LineEnd
+
+
+def assemble_serial(lines: list[str]) -> AsmState:
+    asm_state = AsmState()
+    for line_num, line in enumerate(lines, start=1):
+        asm_line = AsmLine(line[0:-1], line_num)
+        line_address = len(asm_state.bytecode)
+
+        state = LineStart()
+        while not type(state) is LineEnd:
+            state = state.run(asm_state, asm_line)
+
+        if len(asm_state.bytecode) != line_address:
+            asm_state.line_table.append((line_address, line_num))
+    return asm_state
+
+def error_line(assemble, lines: list[str]) -> int | None:
+    try:
+        assemble(lines)
+    except AssemblerError as e:
+        return e.lineNum
+    return None
+
+source = """A .INT #1
+B .BYT 'b'
+C .STR "chunked"
+MAIN ldr r1, A
+  ldb r2, B
+LOOP addi r1, r1, #1
+  jmp LOOP
+  lda r3, C
+END trp #0
+"""
+
+@pytest.fixture(autouse=True)
+def small_chunks(monkeypatch):
+    # split even tiny programs across several chunks
+    monkeypatch.setattr(parallel, "min_chunk_lines", 2)
+
+@pytest.mark.parametrize("jobs", [1, 3])
+def test_matches_serial(jobs):
+    lines = source.splitlines(keepends=True)
+    expected = assemble_serial(lines)
+    result = assemble_parallel(lines, jobs)
+
+    assert result.bytecode == expected.bytecode
+    assert result.code_start == expected.code_start
+    assert result.label_map == expected.label_map
+    assert result.label_lines == expected.label_lines
+    assert result.line_table == expected.line_table
+    assert [(m.label, m.location) for m in result.label_list] == \
+           [(m.label, m.location) for m in expected.label_list]
+
+@pytest.mark.parametrize("bad_lines", [
+    # a directive in a later chunk than the first instruction
+    {6: "X .INT #2\n"},
+    # an error inside a chunk and a directive after code in a later one
+    {5: "  bad r1\n", 8: ".INT #3\n"},
+    # the directive comes first
+    {5: ".INT #4\n", 8: "  bad r1\n"},
+    {1: "A .INT #99999999999\n"},
+])
+def test_error_lines_match_serial(bad_lines):
+    lines = source.splitlines(keepends=True)
+    for line_num, line in bad_lines.items():
+        lines[line_num - 1] = line
+
+    expected = error_line(assemble_serial, lines)
+    assert expected is not None
+    assert error_line(lambda lines: assemble_parallel(lines, 3), lines) == expected
@@ -1,7 +1,7 @@
 import pytest
 
 from asm_types import AsmState, AsmLine, Stage, AssemblerError
-from states import Label, LineStart, Directive, Instruction, LineEnd
+from states import Label, LineStart, Directive, Instruction, LineEnd, assemble_line, assemble_tokens
 
 def test_start_to_label():
     asm_state = AsmState()
@@ -237,4 +237,129 @@ def test_instruction_addi_to_eol():
     assert asm_state.bytecode[-4] == 255
     assert asm_state.bytecode[-3] == 255
     assert asm_state.bytecode[-2] == 255
-    assert asm_state.bytecode[-1] == 255
\ No newline at end of file
+    assert asm_state.bytecode[-1] == 255
+
+def test_instruction_atomics_to_eol():
+    asm_state = AsmState()
+
+    state = Instruction()
+    asm_line = AsmLine("  cas r1, r2, LOCK", 1)
+    asm_line.index = 2
+
+    result = state.run(asm_state, asm_line)
+    assert type(result) is LineEnd
+    assert asm_state.bytecode[-8] == 40
+    assert asm_state.bytecode[-7] == 1
+    assert asm_state.bytecode[-6] == 2
+    assert asm_state.label_list[0].label == "LOCK"
+
+    asm_line.line = "  FAA R4, R5, #8"
+    asm_line.index = 2
+    result = state.run(asm_state, asm_line)
+    assert type(result) is LineEnd
+    assert asm_state.bytecode[-8] == 41
+    assert asm_state.bytecode[-7] == 4
+    assert asm_state.bytecode[-6] == 5
+    assert asm_state.bytecode[-4] == 8
+
+def test_instruction_named_traps():
+    asm_state = AsmState()
+
+    state = Instruction()
+    for line, code in [("  memcpy", 102), ("  MEMSET ; fill", 103), ("  MemCmp\t", 104), ("  PUTS", 105),
+                       ("  alloc", 106), ("  FREE", 107)]:
+        asm_line = AsmLine(line, 1)
+        asm_line.index = 2
+
+        result = state.run(asm_state, asm_line)
+        assert type(result) is LineEnd
+        assert asm_state.bytecode[-8] == 31
+        assert asm_state.bytecode[-4] == code
+        assert asm_state.bytecode[-3] == 0
+
+def test_instruction_named_trap_extra_operand():
+    asm_state = AsmState()
+
+    state = Instruction()
+    asm_line = AsmLine("  memcpy #4", 7)
+    asm_line.index = 2
+
+    with pytest.raises(AssemblerError) as errinfo:
+        result = state.run(asm_state, asm_line)
+        result.run(asm_state, asm_line)
+    assert errinfo.value.lineNum == 7
+
+def test_directive_str():
+    asm_state = AsmState()
+    asm_state.bytecode = bytearray(4)
+
+    state = Directive()
+    asm_line = AsmLine('  .STR "Hi; \\"there\\"\\n" ; greeting', 3)
+    asm_line.index = 2
+
+    result = state.run(asm_state, asm_line)
+    assert type(result) is LineEnd
+    assert asm_state.bytecode[4:] == b'\x0cHi; "there"\n'
+
+    asm_line = AsmLine('  .STR ""', 4)
+    asm_line.index = 2
+    result = state.run(asm_state, asm_line)
+    assert type(result) is LineEnd
+    assert asm_state.bytecode[-1] == 0
+
+def test_directive_str_invalid():
+    for line in ['  .STR', '  .STR "open', "  .STR 'c'", '  .STR "' + "a" * 256 + '"', '  .STR "a" x']:
+        asm_state = AsmState()
+        state = Directive()
+        asm_line = AsmLine(line, 9)
+        asm_line.index = 2
+
+        with pytest.raises(AssemblerError) as errinfo:
+            result = state.run(asm_state, asm_line)
+            result.run(asm_state, asm_line)
+        assert errinfo.value.lineNum == 9
+
+def states_only(asm_state: AsmState, asm_line: AsmLine):
+    state = LineStart()
+    while not type(state) is LineEnd:
+        state = state.run(asm_state, asm_line)
+
+def test_lexer_matches_states():
+    code = ["MAIN movi r1, #0", "  add r1, r1, r2", "L_$0 ldr r2, D0", "\tjmp L1 ; loop", "  cas r1, r2, LOCK",
+            "  movi r3, ','", "  trp #-1", "  memcpy", "", "  ; comment"]
+    data = ["D0 .INT #-5", "  .INT", "  .BYT '\\n'", "  .BYT", '  .STR "a;\\"b\\"" ; c']
+    # directives are only allowed in the data stage
+    for stage, lines in [(Stage.Data, code + data), (Stage.Code, code)]:
+        for line in lines:
+            lexed, expected = AsmState(), AsmState()
+            lexed.stage = expected.stage = stage
+
+            assert assemble_tokens(lexed, AsmLine(line, 3)) is not None
+            states_only(expected, AsmLine(line, 3))
+            assert lexed.bytecode == expected.bytecode
+            assert lexed.label_map == expected.label_map
+            assert [(m.label, m.location) for m in lexed.label_list] == \
+                [(m.label, m.location) for m in expected.label_list]
+            assert lexed.code_start == expected.code_start
+
+def test_lexer_leaves_odd_lines_to_states():
+    # valid without spaces, errors, and anything that isn't ASCII
+    for line in ["  TRP#0", "HELLO", " ", "  mov r1,r2 x", "  .INT #", "  .FOO", "  movi r1, 'é'", "  trp #0\r"]:
+        asm_state = AsmState()
+        assert assemble_tokens(asm_state, AsmLine(line, 5)) is None
+        assert asm_state.bytecode == bytearray(4)
+
+    asm_state = AsmState()
+    assert not assemble_line(asm_state, AsmLine("  TRP#0", 5))
+    assert asm_state.bytecode[4:] == bytearray([31, 0, 0, 0, 0, 0, 0, 0])
+
+    with pytest.raises(AssemblerError) as errinfo:
+        assemble_line(AsmState(), AsmLine("HELLO", 5))
+    assert errinfo.value.lineNum == 5
+
+def test_states_are_shared():
+    asm_state = AsmState()
+    first = LineStart().run(asm_state, AsmLine("  TRP #0", 1))
+    second = LineStart().run(asm_state, AsmLine("  TRP #0", 2))
+    assert type(first) is Instruction
+    assert first is second
@@ -0,0 +1,45 @@
+import io
+
+from asm_types import LabelMarker
+from streaming import StreamingBytecode, SpilledLabelMarkers, SpillList
+
+
+def test_patches_flushed_and_buffered_bytes():
+    out_file = io.BytesIO()
+    bytecode = StreamingBytecode(out_file, buffer_size=8)
+    bytecode.extend(bytes(4))
+    for i in range(20):
+        bytecode.append(i)
+    assert len(bytecode) == 24
+
+    # entirely in the file, straddling the file and buffer, and in the buffer
+    bytecode[0:4] = b"\x01\x02\x03\x04"
+    bytecode[14:18] = b"abcd"
+    bytecode[20:24] = b"wxyz"
+    bytecode.flush()
+
+    expected = bytearray(bytes(4) + bytes(range(20)))
+    expected[0:4] = b"\x01\x02\x03\x04"
+    expected[14:18] = b"abcd"
+    expected[20:24] = b"wxyz"
+    assert out_file.getvalue() == expected
+
+def test_spill_list_keeps_order():
+    records = SpillList("<QQ")
+    for i in range(10000):
+        records.append((i * 8, i))
+    assert len(records) == 10000
+    assert list(records) == [(i * 8, i) for i in range(10000)]
+
+    # appending after reading continues the list
+    records.append((1, 2))
+    assert list(records)[-2:] == [(79992, 9999), (1, 2)]
+
+def test_spilled_label_markers():
+    markers = SpilledLabelMarkers()
+    markers.append(LabelMarker("MAIN", 12))
+    markers.append(LabelMarker("DATA", 20))
+    markers.append(LabelMarker("MAIN", 28))
+
+    assert [(marker.label, marker.location) for marker in markers] == [("MAIN", 12), ("DATA", 20), ("MAIN", 28)]
+    assert markers.labels == ["MAIN", "DATA"]
@@ -0,0 +1,70 @@
+# Generates a benchmark program that does random LDR/STR over a large part of
+# guest memory, to measure the effect of TLB misses (see --hugepages).
+#
+#   python3 random_access.py [--memory=bytes] [--accesses=n] [--iterations=n] out.asm
+#
+# The addresses are fixed when the program is generated (LDR and STR only
+# take immediate addresses), so every iteration touches the same `accesses`
+# random words spread over the memory. The loop has no branch instruction to
+# end it, so the last instruction of each iteration stores the address the
+# closing JMP goes to: the loop start while the counter is above 0, the exit
+# trap after. Run the result with a memory size of at least --memory, e.g.
+#
+#   python3 ../assembler/asm4380.py random_access.asm
+#   time ../build/emu4380 --hugepages=off random_access.bin 1073741824
+#   time ../build/emu4380 --hugepages random_access.bin 1073741824
+import random
+import sys
+
+memory = 1 << 30
+accesses = 4096
+iterations = 2000
+
+args = sys.argv[1:]
+for arg in [arg for arg in args if arg.startswith("--")]:
+    name, _, value = arg.partition("=")
+    if name == "--memory":
+        memory = int(value)
+    elif name == "--accesses":
+        accesses = int(value)
+    elif name == "--iterations":
+        iterations = int(value)
+    else:
+        print("Unknown option: " + arg)
+        sys.exit(1)
+    args.remove(arg)
+if len(args) != 1:
+    print("USAGE: python3 random_access.py [--memory=bytes] [--accesses=n] [--iterations=n] out.asm")
+    sys.exit(1)
+
+# there is no data, so code starts after the 4 byte entry address and every
+# instruction is 8 bytes
+setup = 2
+loop_length = 2 * accesses + 9
+back_jmp = 4 + 8 * (setup + loop_length)
+code_end = back_jmp + 16
+
+# the words accessed are above the program, so it isn't overwritten
+random.seed(4380)
+first_word = (code_end + 3) // 4
+addresses = [4 * random.randrange(first_word, memory // 4) for _ in range(accesses)]
+
+with open(args[0], "w") as out:
+    out.write(f"MAIN movi r2, #{iterations}\n")
+    out.write(f"  movi r8, #{iterations + 1}\n")
+    for i, address in enumerate(addresses):
+        label = "LOOP" if i == 0 else " "
+        out.write(f"{label} ldr r3, #{address}\n")
+        out.write(f"  str r3, #{addresses[i - 1]}\n")
+    # r3 = 1 while r2 > 0, else 0, and the JMP goes to LOOP or END
+    out.write("  subi r2, r2, #1\n")
+    out.write(f"  addi r3, r2, #{iterations}\n")
+    out.write("  div r3, r3, r8\n")
+    out.write("  lda r4, LOOP\n")
+    out.write("  lda r5, END\n")
+    out.write("  sub r4, r4, r5\n")
+    out.write("  mul r4, r4, r3\n")
+    out.write("  add r4, r4, r5\n")
+    out.write(f"  str r4, #{back_jmp + 4}\n")
+    out.write("  jmp END\n")
+    out.write("END trp #0\n")
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <ostream>
+
+#include "symbols.h"
+
+// Guest code coverage. With the coverage run loop every executed instruction
+// sets its byte in coverage_map (see emu4380.h) with one store and no branch.
+//
+// The report has a summary line, one line per code label when a symbol table
+// is given (the slots from the label up to the next label), and the bitmap of
+// the code range, one bit per 8 byte slot, least significant bit first:
+//
+//   covered <executed slots> <slots>
+//   label <name> <executed slots> <slots>
+//   bitmap <code start> <slots>
+//   <hex, 32 bytes per line>
+
+// allocates a cleared map for the current MEM_SIZE
+bool start_coverage();
+
+void write_coverage(std::ostream& out, unsigned int code_start, unsigned int code_end,
+                    const SymbolTable* symbols);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "emu4380.h"
+#include "loader.h"
+#include "symbols.h"
+
+// Disassembler and static control flow graph, used by emu4380-dis.
+//
+// The code range of a loaded image is split into basic blocks. A block starts
+// at the entry point, a jump target, a spawned core's entry (an address moved
+// into R3 in the same block before TRP #100) or after an instruction that
+// doesn't fall through, and ends before the next such start. Edges are JMP,
+// MOVI PC and LDA PC targets and fall-throughs. TRP #0 and invalid
+// instructions end a path; any other write to PC is an indirect jump whose
+// targets aren't known, so its block is marked `indirect` and has no
+// successors.
+//
+// Loops are natural loops: a back edge goes to a block that dominates its
+// source, and the loop is every block that reaches the source without going
+// through the header. Loops with the same header are merged.
+
+// assembly text for one instruction, e.g. "ADDI R1, R1, #4". Jump targets are
+// written as labels when symbols has one at the address.
+std::string disassemble(Instruction inst, const SymbolTable* symbols = nullptr);
+
+struct BasicBlock {
+  unsigned int start;
+  unsigned int end;  // one past the last instruction
+  std::vector<unsigned int> successors;  // block indexes
+  bool reachable = false;
+  bool indirect = false;
+  bool invalid = false;  // ends at an instruction that fails to decode
+  unsigned int loop_depth = 0;
+  std::map<std::string, unsigned int> mix;  // mnemonic -> count
+};
+
+struct Loop {
+  unsigned int header;  // block index
+  std::vector<unsigned int> blocks;
+  unsigned int depth;  // 1 for outermost loops
+};
+
+struct ControlFlowGraph {
+  unsigned int entry;
+  std::vector<BasicBlock> blocks;
+  std::vector<Loop> loops;
+};
+
+// Builds the graph for the code in [image.code_start, image.code_end). The
+// image must already be loaded into prog_mem.
+ControlFlowGraph build_cfg(const ProgramImage& image);
+
+// listing of every block with its instructions, successors and mix, then the
+// loops and the unreachable blocks
+void write_cfg_text(std::ostream& out, const ControlFlowGraph& cfg, const SymbolTable* symbols = nullptr);
+
+// the graph in Graphviz DOT format, unreachable blocks dashed
+void write_cfg_dot(std::ostream& out, const ControlFlowGraph& cfg, const SymbolTable* symbols = nullptr);
@@ -1,49 +1,173 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+#include <ostream>
 #include <string>
 #include <vector>
 extern unsigned int MEM_SIZE;
 
-extern unsigned int reg_file[22];
+// Every core has its own registers and flag, memory is shared (see smp.h).
+extern thread_local unsigned int reg_file[22];
 extern unsigned char* prog_mem;
-extern unsigned int cntrl_regs[5];
+extern thread_local unsigned int cntrl_regs[5];
 
 enum RegNames { R0=0, R1, R2, R3, R4, R5, R6, R7, R8, R9, R10, R11, R12, R13, R14, R15, PC, SL, SB, SP, FP, HP };
 enum CntrlRegNames{ OPERATION, OPERAND_1, OPERAND_2, OPERAND_3, IMMEDIATE };
-enum Operations{JMP=1, MOV=7, MOVI, LDA, STR, LDR, STB, LDB, ADD = 18, ADDI, SUB, SUBI, MUL, MULI, DIV, SDIV, DIVI, TRP=31};
+enum Operations{JMP=1, MOV=7, MOVI, LDA, STR, LDR, STB, LDB, ADD = 18, ADDI, SUB, SUBI, MUL, MULI, DIV, SDIV, DIVI, TRP=31, CAS=40, FAA};
 
 enum PostOpFlag {
   NOTHING = 0,
   TERMINATE
 };
 
-extern PostOpFlag flag;
+extern thread_local PostOpFlag flag;
+
+// called with the target of every JMP on this core when set, used by the profiler
+extern thread_local void (*jump_hook)(unsigned int target);
+
+// A fetched instruction. Packed into 8 bytes so it is passed to the execute
+// functions by value in a single register instead of through cntrl_regs.
+struct Instruction {
+  unsigned char operation;
+  unsigned char operand_1;
+  unsigned char operand_2;
+  unsigned char operand_3;
+  unsigned int immediate;
+};
+
+// Guest memory is little endian. These go through memcpy so they are
+// alignment safe and the byte swap compiles away on little endian hosts.
+inline std::uint32_t load_word(const unsigned char* src) {
+  std::uint32_t word;
+  std::memcpy(&word, src, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap32(word);
+#endif
+  return word;
+}
+
+inline void store_word(unsigned char* dest, std::uint32_t word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap32(word);
+#endif
+  std::memcpy(dest, &word, sizeof(word));
+}
+
+// Splits the 8 instruction bytes at src into their fields with one 64-bit load.
+inline Instruction decode_instruction(const unsigned char* src) {
+  std::uint64_t word;
+  std::memcpy(&word, src, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+
+  Instruction inst;
+  inst.operation = (unsigned char)word;
+  inst.operand_1 = (unsigned char)(word >> 8);
+  inst.operand_2 = (unsigned char)(word >> 16);
+  inst.operand_3 = (unsigned char)(word >> 24);
+  inst.immediate = (unsigned int)(word >> 32);
+  return inst;
+}
+
+// Guest memory is an arena that is kept between runs. init_mem with the size
+// it already has only zeroes the pages the last run wrote to, any other size
+// (or none yet) replaces it with a fresh zeroed one.
+//
+// Writes are tracked one byte per page in mem_dirty by the instructions and
+// traps that store to memory and by load_image. Anything else writing to
+// prog_mem must call mark_dirty, or use free_mem to start over.
+const unsigned int MEM_PAGE_SHIFT = 12;
+extern unsigned char* mem_dirty;
+
+inline void mark_dirty(unsigned int address, unsigned int length) {
+  if (mem_dirty == nullptr || length == 0) {
+    return;
+  }
+  unsigned int last = (unsigned int)(((unsigned long long)address + length - 1) >> MEM_PAGE_SHIFT);
+  for (unsigned int page = address >> MEM_PAGE_SHIFT; page <= last; page++) {
+    // relaxed so cores marking the same page don't race
+    __atomic_store_n(&mem_dirty[page], 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Guest memory of at least HUGE_PAGE_AUTO_SIZE (any size from one huge page
+// up with HUGE_PAGES_ON) is mapped on huge page boundaries and advised to use
+// transparent huge pages, so random access over it misses the TLB less. If
+// that can't be mapped it falls back to normal pages. mem_huge_pages tells
+// whether the kernel took the advice for the current arena.
+enum HugePageMode { HUGE_PAGES_AUTO, HUGE_PAGES_ON, HUGE_PAGES_OFF };
+const std::size_t HUGE_PAGE_SIZE = 2 << 20;
+const unsigned int HUGE_PAGE_AUTO_SIZE = 256 << 20;
+extern HugePageMode huge_page_mode;
+extern bool mem_huge_pages;
 
 bool init_mem(unsigned int size);
+// Like init_mem, but the arena (and its dirty pages) is shared with forked
+// processes and faulted in up front. Used by the server's worker pools.
+bool init_shared_mem(unsigned int size);
+// zeroes the pages written since the arena was created or last reset
+void reset_mem();
+void free_mem();
 
+// spec interface, operates on cntrl_regs
 bool fetch();
 bool decode();
 bool execute();
 
+// register based interface used by the emulator loop
+bool fetch(Instruction& inst);
+bool decode(Instruction inst);
+bool execute(Instruction inst);
+// fetch, decode and execute the instruction at PC
+bool step();
+
+// Runs this core until it executes TRP #0 (true) or an invalid instruction
+// (false, with its address in failed_address).
+typedef bool (*RunLoop)(unsigned int& failed_address);
+
+// The loop every core runs. select_run_loop picks the instantiation with
+// exactly the given options compiled in (see ExecPolicy in emu4380.cpp), the
+// default has none of them.
+//   jump_hook  JMP calls jump_hook (step() always does)
+//   trace      each instruction is written to stderr as
+//              "TRACE <address>: <operation> <op1> <op2> <op3> <immediate>"
+//   counters   executed instructions are counted in instruction_counts
+//   coverage   executed instructions are marked in coverage_map
+extern RunLoop run_loop;
+RunLoop select_run_loop(bool jump_hook, bool trace, bool counters, bool coverage);
+
+// executed instructions per operation, only counted when enabled
+extern std::uint64_t instruction_counts[256];
+void write_instruction_counts(std::ostream& out);
+
+// One byte per 8 byte slot of memory, set to 1 when an instruction at an
+// address in the slot runs (see coverage.h). A byte instead of a bit so
+// marking is a single store.
+extern unsigned char* coverage_map;
+
 // execute instruction functions
-bool jmp();
-bool mov();
-bool movi();
-bool lda();
-bool str();
-bool ldr();
-bool stb();
-bool ldb();
-bool add();
-bool addi();
-bool sub();
-bool subi();
-bool mul();
-bool muli();
-bool div();
-bool sdiv();
-bool divi();
-bool trp();
+bool jmp(Instruction inst);
+bool mov(Instruction inst);
+bool movi(Instruction inst);
+bool lda(Instruction inst);
+bool str(Instruction inst);
+bool ldr(Instruction inst);
+bool stb(Instruction inst);
+bool ldb(Instruction inst);
+bool add(Instruction inst);
+bool addi(Instruction inst);
+bool sub(Instruction inst);
+bool subi(Instruction inst);
+bool mul(Instruction inst);
+bool muli(Instruction inst);
+bool div(Instruction inst);
+bool sdiv(Instruction inst);
+bool divi(Instruction inst);
+bool trp(Instruction inst);
+bool cas(Instruction inst);
+bool faa(Instruction inst);
 
 // convenience categorization of operations
 extern std::vector<unsigned int> operations_0operand_3dc;
@@ -0,0 +1,32 @@
+#pragma once
+
+// Guest heap.
+//
+// The memory from the end of the loaded image to the end of guest memory is a
+// heap handed out by two traps:
+//
+//   TRP #106  allocate R3 bytes. The block's address is returned in R3, or
+//             -1 if the heap is full. Blocks are 8 byte aligned and not
+//             zeroed.
+//   TRP #107  free the block at the address in R3. R3 is set to 0, or -1 if
+//             it isn't an allocated block.
+//
+// Sizes are rounded up to a power of two (at least HEAP_MIN_BLOCK) and freed
+// blocks go on a free list per size, which later allocations of that size
+// take from. Otherwise a block is cut from the top of the heap, the only
+// point where it is checked against the end of memory. Freeing the top block
+// gives its space back. HP always holds the top of the heap on the core that
+// made the last call.
+//
+// Which blocks are allocated, and their sizes, is kept on the host, so guest
+// stores can't corrupt the allocator. The heap is shared by all cores.
+const unsigned int HEAP_MIN_BLOCK = 8;
+
+// Empties the heap and starts it at `start` (rounded up to HEAP_MIN_BLOCK).
+// Called by load_image with the end of the image.
+void init_heap(unsigned int start);
+
+// False if there is no room for the block.
+bool heap_alloc(unsigned int size, unsigned int& address);
+// False if address isn't an allocated block.
+bool heap_free(unsigned int address);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// A part of the binary file that is copied into memory at `address`.
+struct Segment {
+  unsigned int address;
+  unsigned int offset;
+  unsigned int size;
+};
+
+// A parsed program binary.
+//
+// Version 1 binaries are a 4 byte entry address followed by the data and code,
+// all of which is copied to address 0. Version 2 binaries start with a header
+// (see assembler/bin_format.py) describing separate data and code segments, a
+// zero filled bss run between them and a hash of the contents. Both produce
+// the same memory contents.
+struct ProgramImage {
+  unsigned int version;
+  unsigned int entry;
+  // [code_start, code_end) holds the instructions
+  unsigned int code_start;
+  unsigned int code_end;
+  // memory needed to hold the whole image
+  unsigned long long end;
+  std::vector<Segment> segments;
+  std::vector<unsigned char> bytes;
+};
+
+// Parses a version 1 or 2 binary. On failure `error` says what is wrong.
+bool parse_image(std::vector<unsigned char> bytes, ProgramImage& image, std::string& error);
+
+// Reads an image framed as a u32 little endian length followed by that many
+// bytes from fd, and nothing past it, so whatever follows on the stream is
+// left for the program to read. False if the stream ends early.
+bool read_framed_image(int fd, std::vector<unsigned char>& bytes);
+
+// Copies the image into prog_mem, points PC at the entry address and starts
+// the heap (see heap.h) after the image.
+// Memory must already be initialized and at least `image.end` bytes.
+void load_image(const ProgramImage& image);
+
+// 64-bit FNV-1a, the content hash used by version 2 binaries
+unsigned long long fnv1a_64(const unsigned char* data, size_t size,
+                            unsigned long long hash = 0xcbf29ce484222325ull);
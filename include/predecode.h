@@ -0,0 +1,55 @@
+#pragma once
+
+#include "emu4380.h"
+#include <cstdint>
+
+// Pre-decoded instructions.
+//
+// When a program is loaded every 8 byte slot of its code range is decoded
+// once, and for DIVI and MULI the arithmetic is planned from the immediate:
+// division by a constant becomes a multiply by a magic number and a shift
+// (Hacker's Delight, chapter 10), powers of two become shifts and a zero
+// divisor is known to fail up front. step() then runs slots straight from the
+// table, skipping decode(). Loads and stores whose address fits in memory are
+// marked so they run without checking it again.
+//
+// Each entry keeps the raw instruction bytes it was built from and is only
+// used while memory still holds those bytes, so code that is overwritten
+// (by a store, a trap or another core) falls back to the normal path. The
+// table is never written after it is built, so cores share it without locks.
+enum class ArithPlan : unsigned char {
+  NONE,        // execute the instruction as usual
+  DIV_ZERO,    // DIVI by 0, always fails
+  COPY,        // DIVI/MULI by 1
+  NEGATE,      // DIVI by -1
+  SHIFT,       // DIVI/MULI by a power of two (DIVI negates after if negative)
+  MAGIC        // DIVI by any other constant
+};
+
+struct Predecoded {
+  std::uint64_t word;   // instruction bytes as they were in memory
+  Instruction inst;
+  ArithPlan plan;
+  unsigned char shift;
+  bool negate;
+  signed char correction;  // add (+1) or subtract (-1) the dividend after the multiply
+  std::int32_t magic;
+  bool address_checked;   // a load or store whose address is in bounds
+};
+
+// Signed 32-bit division by d as q = mulhi(magic, n) (+/- n) >> shift, with 1
+// added to negative quotients. d must not be -1, 0, 1 or a power of two.
+void divide_plan(std::int32_t d, Predecoded& entry);
+
+// Builds the table for the instructions in [code_start, code_end) of
+// prog_mem, replacing any previous one.
+void predecode(unsigned int code_start, unsigned int code_end);
+void clear_predecode();
+
+// The entry for the instruction at address, or nullptr if there is none or
+// memory no longer holds the bytes it was built from.
+const Predecoded* find_predecoded(unsigned int address);
+
+// Executes the planned arithmetic of an entry whose plan isn't NONE. PC must
+// already point past it.
+bool execute_plan(const Predecoded& entry);
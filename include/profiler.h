@@ -0,0 +1,26 @@
+#pragma once
+
+#include <ostream>
+
+#include "symbols.h"
+
+// Sampling profiler. A periodic timer raises SIGPROF `frequency` times per
+// second and the handler counts the current PC in a fixed size table, so the
+// emulator loop itself does no extra work per instruction.
+bool start_sample_profile(unsigned int frequency);
+void stop_sample_profile();
+
+// Labels and source lines used to name sampled addresses. The table must
+// outlive the profiler.
+void set_profile_symbols(const SymbolTable* symbols);
+
+// Tracks a call-like stack of JMP targets so samples can be written as
+// folded stacks. There are no call instructions, so a jump to a label already
+// on the stack pops back to it (a loop or a return), any other jump pushes.
+void start_profile_stacks(unsigned int entry);
+
+// writes the sampled addresses, most frequent first
+void write_sample_profile(std::ostream& out);
+
+// writes the samples in the folded stack format used by flamegraph.pl
+void write_folded_stacks(std::ostream& out);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Run result cache.
+//
+// A single-core run is deterministic given its binary, memory size and
+// stdin, so its output and exit code can be replayed instead of emulated.
+// Entries are files in the cache directory named by result_key, holding the
+// i32 exit code (little endian) followed by the output bytes. A hit updates
+// the entry's modification time, and after a new entry is written the least
+// recently used ones are removed until the directory is at most `size_limit`
+// bytes (the new entry is always kept).
+//
+// The key also covers the emulator executable, so a rebuilt emulator doesn't
+// replay results of the old one.
+std::string result_key(const std::vector<unsigned char>& image, unsigned int mem_size,
+                       const std::vector<unsigned char>& input);
+
+void evict_results(const std::string& cache_dir, unsigned long long size_limit, const std::string& keep);
+
+// Reads all of stdin, then replays the cached result or calls `run` in a
+// forked child with stdin coming from what was read, copies its output to
+// stdout and caches it. Returns the exit code. Runs killed by a signal
+// aren't cached. Not meant for a terminal on stdin, where it would wait for
+// end of input before the program prints anything.
+int run_with_result_cache(const std::string& cache_dir, unsigned long long size_limit,
+                          const std::vector<unsigned char>& image, unsigned int mem_size,
+                          const std::function<int()>& run);
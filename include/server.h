@@ -0,0 +1,43 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Server mode.
+//
+// `run_server` listens on a Unix socket with `workers` pre-forked worker
+// processes. Each worker maps a `pool_size` byte block of guest memory up
+// front (already faulted in) and keeps it for its whole life. A job runs in
+// a fork of its worker that uses the pool as prog_mem, so it pays for
+// neither exec, dynamic linking nor allocating and faulting in memory. The
+// worker zeroes what the job used once the result has been sent.
+//
+// Protocol, all integers little endian:
+//
+//   request   u8 kind (0 = path to a binary, 1 = inline binary)
+//             u32 memory size, u32 length + binary or path bytes,
+//             u32 length + stdin bytes
+//   response  any number of frames: u8 type, u32 length, payload
+//             type 1  program output
+//             type 2  end of the job: i32 exit code, u64 run time in
+//                     microseconds, u64 peak resident set size in KiB
+//
+// The server closes the connection after the end frame.
+enum ServerFrame { OUTPUT_FRAME = 1, EXIT_FRAME = 2 };
+
+struct ServerJob {
+  unsigned int mem_size;
+  std::vector<unsigned char> image;
+};
+
+// Never returns unless the socket can't be set up, in which case it prints
+// why and returns 3. `run` is called in the job's process with prog_mem and
+// MEM_SIZE already pointing at the pool, stdin and stdout connected to the
+// job's input and the client, and its return value is the exit code.
+int run_server(const std::string& socket_path, unsigned int pool_size, unsigned int workers,
+               const std::function<int(const ServerJob&)>& run);
+
+// Sends stdin and an inline binary to the server, copies the output to stdout
+// and returns the job's exit code, or 3 if the server can't be reached.
+int run_client(const std::string& socket_path, const ServerJob& job);
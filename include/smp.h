@@ -0,0 +1,29 @@
+#pragma once
+
+// Multi-core mode.
+//
+// Every core runs on its own host thread with its own registers (reg_file,
+// cntrl_regs and flag are thread_local) over the shared prog_mem. Core 0 is
+// the thread that runs the program from its entry point. Other cores are
+// started and waited on with traps:
+//
+//   TRP #100  spawn a core at the address in R3. Its registers start at 0
+//             except PC and R3, which gets the value of R4. The new core's id
+//             is returned in R3, or -1 if `max_cores` are already running.
+//   TRP #101  wait for the core whose id is in R3 to execute TRP #0. R3 is
+//             set to 0, or -1 if there is no such core to join.
+//
+// TRP #0 on core 0 ends the whole program, including cores still running.
+//
+// Memory ordering: CAS and FAA are sequentially consistent and act as full
+// fences. Plain loads and stores are unordered between cores, so data shared
+// without a CAS/FAA in between may be seen late or in a different order. A
+// spawn happens before the new core's first instruction, and everything a
+// core did happens before the join that waits for it returns.
+extern unsigned int max_cores;
+
+bool spawn_core(unsigned int entry, unsigned int argument, unsigned int& core_id);
+bool join_core(unsigned int core_id);
+// whether TRP #100 has started a core, after which the process must not end
+// with exit (see smp.cpp)
+bool cores_started();
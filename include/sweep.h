@@ -0,0 +1,32 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// result of running the loaded program against one input file
+struct SweepResult {
+  std::string input;
+  std::string output;
+  int exit_code;
+  double seconds;
+};
+
+// Collects the input files for a sweep. A directory contributes every regular
+// file in it (sorted by name), any other path is read as a list of input
+// files, one per line.
+bool collect_sweep_inputs(const std::string& source, std::vector<std::string>& inputs);
+
+// Runs the program already loaded into memory once per input file, with at
+// most `jobs` runs in flight at a time. Every run is a fork of the current
+// process, so the loaded image is shared copy-on-write instead of being read
+// and copied again. Each run's stdout is captured to `<out_dir>/<input name>.out`,
+// where inputs whose name was already used get `.2`, `.3`, ... appended to it.
+// `run` is called in the child with the run's input and output paths filled
+// in, and its return value is the run's exit code.
+std::vector<SweepResult> run_sweep(const std::vector<std::string>& inputs,
+                                   const std::string& out_dir, unsigned int jobs,
+                                   const std::function<int(const SweepResult&)>& run);
+
+// prints a table with one row per run
+void print_sweep_summary(const std::vector<SweepResult>& results);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// a label from an assembler symbol file
+struct Symbol {
+  unsigned int address;
+  unsigned int line;
+  std::string name;
+};
+
+// Labels and source lines from the `.sym` sidecar written by
+// `asm4380.py --symbols`. Both lists are sorted by address.
+struct SymbolTable {
+  std::vector<Symbol> labels;
+  std::vector<std::pair<unsigned int, unsigned int>> lines;
+};
+
+bool load_symbols(const std::string& path, SymbolTable& table);
+
+// the closest label at or below `address`, nullptr if there is none
+const Symbol* find_label(const SymbolTable& table, unsigned int address);
+
+// the source line that emitted the byte at `address`, 0 if unknown
+unsigned int find_line(const SymbolTable& table, unsigned int address);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "predecode.h"
+#include <vector>
+
+// Hot traces.
+//
+// The emulator loop counts how often control jumps to each address. When an
+// address has been jumped to HOT_TRACE_THRESHOLD times, the predecoded
+// instructions executed from it are recorded until control returns to it.
+// Later jumps there replay the recorded loop from a flat array without going
+// back to the emulator loop, instead of looking up and checking every
+// instruction. A recording that reaches an instruction that can't be traced
+// (one that wasn't predecoded, a TRP, or the HOT_TRACE_MAX_STEPS'th) first is
+// dropped, since checking a trace on entry costs about what replaying one
+// iteration of it saves.
+//
+// Steps whose next address depends on registers (a MOV, LDR, ADD, ... into
+// PC) are guarded: if the next PC isn't the recorded one, replay stops there
+// and the emulator loop carries on (a side exit). A trace is checked against
+// memory when it is entered. While it runs only its own stores can change
+// its code, as traces hold no TRPs and are only used with a single core, so
+// a step that stores into the trace's instructions checks them afterwards
+// and exits if they changed. Loops that end by patching their closing JMP
+// replay until the iteration that patches it.
+const unsigned int HOT_TRACE_THRESHOLD = 64;
+const unsigned int HOT_TRACE_MAX_STEPS = 4096;
+
+struct HotTraceStep {
+  const Predecoded* entry;
+  unsigned int address;
+  unsigned int next;  // the address executed after this one when recorded
+  bool guard;         // next depends on registers, check it
+  // instructions of the trace this step stores into, checked after it runs
+  unsigned char rewrite_count;
+  unsigned int rewrites[2];
+};
+
+// the last step goes back to the head
+struct HotTrace {
+  unsigned int head;
+  std::vector<HotTraceStep> steps;
+};
+
+// off unless --hot-traces is given
+extern bool hot_traces_enabled;
+
+// Counts a jump to address. Returns its trace if it has one and memory still
+// holds the instructions it was recorded from. Sets `record` when the address
+// just became hot and its trace should be recorded from here.
+const HotTrace* jumped_to(unsigned int address, bool& record);
+
+// Recording: begin_trace at the head, then record_step before executing each
+// instruction. record_step returns false once the trace is finished (kept if
+// it got back to the head) and recording should stop.
+void begin_trace(unsigned int head);
+bool record_step(unsigned int address);
+
+// Drops every trace and count. Called whenever the predecode table changes.
+void clear_traces();
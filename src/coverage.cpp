@@ -0,0 +1,58 @@
+#include "../include/coverage.h"
+#include "../include/emu4380.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <new>
+#include <vector>
+
+bool start_coverage() {
+  delete[] coverage_map;
+  coverage_map = new (std::nothrow) unsigned char[MEM_SIZE / 8 + 1]();
+  return coverage_map != nullptr;
+}
+
+static unsigned int covered_slots(unsigned int start, unsigned int end) {
+  unsigned int covered = 0;
+  for (unsigned int address = start; address < end && end - address >= 8; address += 8) {
+    covered += coverage_map[address >> 3];
+  }
+  return covered;
+}
+
+void write_coverage(std::ostream& out, unsigned int code_start, unsigned int code_end,
+                    const SymbolTable* symbols) {
+  unsigned int slots = code_end > code_start ? (code_end - code_start) / 8 : 0;
+  out << "covered " << covered_slots(code_start, code_end) << " " << slots << "\n";
+
+  if (symbols != nullptr) {
+    auto& labels = symbols->labels;
+    for (size_t i = 0; i < labels.size(); i++) {
+      auto start = labels[i].address;
+      if (start < code_start || start >= code_end) {
+        continue;
+      }
+      // labels at the same address share the range
+      auto end = code_end;
+      for (size_t next = i + 1; next < labels.size(); next++) {
+        if (labels[next].address > start) {
+          end = std::min(end, labels[next].address);
+          break;
+        }
+      }
+      out << "label " << labels[i].name << " " << covered_slots(start, end) << " "
+          << (end - start) / 8 << "\n";
+    }
+  }
+
+  out << "bitmap " << code_start << " " << slots << "\n";
+  std::vector<unsigned char> bits((slots + 7) / 8);
+  for (unsigned int slot = 0; slot < slots; slot++) {
+    bits[slot / 8] |= coverage_map[(code_start + slot * 8) >> 3] << (slot % 8);
+  }
+  char hex[3];
+  for (size_t i = 0; i < bits.size(); i++) {
+    std::snprintf(hex, sizeof(hex), "%02x", bits[i]);
+    out << hex << ((i % 32 == 31 || i == bits.size() - 1) ? "\n" : "");
+  }
+}
@@ -0,0 +1,76 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "../include/disasm.h"
+#include "../include/emu4380.h"
+#include "../include/loader.h"
+#include "../include/symbols.h"
+
+// emu4380-dis [--dot] [--symbols=<file>] <binary>
+//
+// Prints the control flow graph of a binary's code, as a listing by default
+// or in Graphviz DOT format with --dot.
+int main(int argc, char* argv[]) {
+    bool dot = false;
+    std::string symbols_path;
+    std::string binary_path;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--dot") {
+            dot = true;
+        }
+        else if (arg.rfind("--symbols=", 0) == 0 && arg.size() > 10) {
+            symbols_path = arg.substr(10);
+        }
+        else if (arg.rfind("--", 0) != 0 && binary_path.empty()) {
+            binary_path = arg;
+        }
+        else {
+            binary_path.clear();
+            break;
+        }
+    }
+    if (binary_path.empty()) {
+        std::cout << "Usage: emu4380-dis [--dot] [--symbols=<file>] <binary>\n";
+        return 3;
+    }
+
+    std::ifstream in_file(binary_path, std::ios_base::binary);
+    if (!in_file) {
+        std::cout << "Could not open " << binary_path << "\n";
+        return 3;
+    }
+    std::vector<unsigned char> program((std::istreambuf_iterator<char>(in_file)), std::istreambuf_iterator<char>());
+
+    ProgramImage image;
+    std::string error;
+    if (!parse_image(std::move(program), image, error)) {
+        std::cout << "INVALID BINARY: " << error << "\n";
+        return 6;
+    }
+    // just enough memory to hold the image
+    if (image.end > 0xffffffffull || !init_mem(image.end == 0 ? 8 : (unsigned int)image.end)) {
+        std::cout << "INSUFFICIENT MEMORY SPACE\n";
+        return 2;
+    }
+    load_image(image);
+
+    SymbolTable symbols;
+    if (!symbols_path.empty() && !load_symbols(symbols_path, symbols)) {
+        std::cout << "Could not read symbols from " << symbols_path << "\n";
+        return 3;
+    }
+    const SymbolTable* table = symbols_path.empty() ? nullptr : &symbols;
+
+    ControlFlowGraph cfg = build_cfg(image);
+    if (dot) {
+        write_cfg_dot(std::cout, cfg, table);
+    }
+    else {
+        write_cfg_text(std::cout, cfg, table);
+    }
+    free_mem();
+    return 0;
+}
@@ -0,0 +1,388 @@
+#include "../include/disasm.h"
+
+#include <algorithm>
+#include <set>
+#include <sstream>
+
+// operands an operation takes, in assembly order
+struct Form {
+  const char* name;
+  unsigned int registers;
+  bool immediate;
+  bool address;  // the immediate is an address, not a signed value
+};
+
+static const std::map<unsigned int, Form> forms = {
+  {JMP, {"JMP", 0, true, true}},    {MOV, {"MOV", 2, false, false}},   {MOVI, {"MOVI", 1, true, false}},
+  {LDA, {"LDA", 1, true, true}},    {STR, {"STR", 1, true, true}},     {LDR, {"LDR", 1, true, true}},
+  {STB, {"STB", 1, true, true}},    {LDB, {"LDB", 1, true, true}},     {ADD, {"ADD", 3, false, false}},
+  {ADDI, {"ADDI", 2, true, false}}, {SUB, {"SUB", 3, false, false}},   {SUBI, {"SUBI", 2, true, false}},
+  {MUL, {"MUL", 3, false, false}},  {MULI, {"MULI", 2, true, false}}, {DIV, {"DIV", 3, false, false}},
+  {SDIV, {"SDIV", 3, false, false}}, {DIVI, {"DIVI", 2, true, false}}, {TRP, {"TRP", 0, true, true}},
+  {CAS, {"CAS", 2, true, true}},    {FAA, {"FAA", 2, true, true}}};
+
+// the traps the assembler has names for
+static const std::map<unsigned int, const char*> trap_names = {
+  {102, "MEMCPY"}, {103, "MEMSET"}, {104, "MEMCMP"}, {105, "PUTS"}, {106, "ALLOC"}, {107, "FREE"}};
+
+static const char* register_names[] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9", "R10",
+                                       "R11", "R12", "R13", "R14", "R15", "PC", "SL", "SB", "SP", "FP", "HP"};
+
+// operations whose first operand is the register they write
+static const std::set<unsigned int> writes_operand_1 = {MOV, MOVI, LDA, LDR, LDB, ADD, ADDI, SUB, SUBI, MUL,
+                                                        MULI, DIV, SDIV, DIVI, CAS, FAA};
+// traps that return a value in R3
+static const std::set<unsigned int> traps_writing_r3 = {2, 4, 100, 101, 104, 106, 107};
+
+static const Symbol* label_at(const SymbolTable* symbols, unsigned int address) {
+  if (symbols == nullptr) {
+    return nullptr;
+  }
+  const Symbol* label = find_label(*symbols, address);
+  return label != nullptr && label->address == address ? label : nullptr;
+}
+
+static std::string mnemonic(Instruction inst) {
+  if (inst.operation == TRP && trap_names.count(inst.immediate)) {
+    return trap_names.at(inst.immediate);
+  }
+  auto form = forms.find(inst.operation);
+  return form == forms.end() ? "INVALID" : form->second.name;
+}
+
+std::string disassemble(Instruction inst, const SymbolTable* symbols) {
+  if (!decode(inst)) {
+    std::ostringstream text;
+    text << "INVALID " << (unsigned int)inst.operation << " " << (unsigned int)inst.operand_1 << " "
+         << (unsigned int)inst.operand_2 << " " << (unsigned int)inst.operand_3 << " #" << inst.immediate;
+    return text.str();
+  }
+  if (inst.operation == TRP && trap_names.count(inst.immediate)) {
+    return trap_names.at(inst.immediate);
+  }
+
+  const Form& form = forms.at(inst.operation);
+  std::ostringstream text;
+  text << form.name;
+  const unsigned char operands[] = {inst.operand_1, inst.operand_2, inst.operand_3};
+  for (unsigned int i = 0; i < form.registers; i++) {
+    text << (i == 0 ? " " : ", ") << register_names[operands[i]];
+  }
+  if (form.immediate) {
+    text << (form.registers == 0 ? " " : ", ");
+    const Symbol* label = form.address && inst.operation != TRP ? label_at(symbols, inst.immediate) : nullptr;
+    if (label != nullptr) {
+      text << label->name;
+    }
+    else if (form.address) {
+      text << "#" << inst.immediate;
+    }
+    else {
+      text << "#" << (int)inst.immediate;
+    }
+  }
+  return text.str();
+}
+
+// how control leaves an instruction
+enum class Exit { FALL_THROUGH, JUMP, STOP, INDIRECT };
+
+static Exit exit_of(Instruction inst, bool valid) {
+  if (!valid || (inst.operation == TRP && inst.immediate == 0)) {
+    return Exit::STOP;
+  }
+  // MOVI and LDA into PC load their immediate, so they jump just like JMP
+  bool constant_pc = (inst.operation == MOVI || inst.operation == LDA) && inst.operand_1 == PC;
+  if (inst.operation == JMP || constant_pc) {
+    return Exit::JUMP;
+  }
+  if (writes_operand_1.count(inst.operation) && inst.operand_1 == PC) {
+    return Exit::INDIRECT;
+  }
+  return Exit::FALL_THROUGH;
+}
+
+// the natural loop of the back edge source -> header
+static std::set<unsigned int> natural_loop(const std::vector<std::vector<unsigned int>>& predecessors,
+                                           unsigned int header, unsigned int source) {
+  std::set<unsigned int> loop = {header, source};
+  std::vector<unsigned int> work = {source};
+  while (!work.empty()) {
+    unsigned int block = work.back();
+    work.pop_back();
+    if (block == header) {
+      continue;
+    }
+    for (unsigned int pred : predecessors[block]) {
+      if (loop.insert(pred).second) {
+        work.push_back(pred);
+      }
+    }
+  }
+  return loop;
+}
+
+ControlFlowGraph build_cfg(const ProgramImage& image) {
+  ControlFlowGraph cfg;
+  cfg.entry = image.entry;
+  unsigned int code_start = image.code_start;
+  unsigned int code_end = std::min<unsigned long long>(image.code_end, MEM_SIZE);
+  if (code_end < code_start + 8) {
+    return cfg;
+  }
+
+  unsigned int slots = (code_end - code_start) / 8;
+  code_end = code_start + slots * 8;
+  std::vector<Instruction> code(slots);
+  std::vector<bool> valid(slots);
+  for (unsigned int i = 0; i < slots; i++) {
+    code[i] = decode_instruction(prog_mem + code_start + i * 8);
+    valid[i] = decode(code[i]);
+  }
+  auto is_slot = [&](unsigned int address) {
+    return address >= code_start && address < code_end && (address - code_start) % 8 == 0;
+  };
+
+  // blocks start at the entry, jump targets and after instructions that
+  // don't fall through
+  std::set<unsigned int> leaders = {code_start};
+  std::vector<unsigned int> roots;
+  if (is_slot(image.entry)) {
+    leaders.insert(image.entry);
+    roots.push_back(image.entry);
+  }
+  for (unsigned int i = 0; i < slots; i++) {
+    Exit exit = exit_of(code[i], valid[i]);
+    if (exit == Exit::JUMP && is_slot(code[i].immediate)) {
+      leaders.insert(code[i].immediate);
+    }
+    if (exit != Exit::FALL_THROUGH && i + 1 < slots) {
+      leaders.insert(code_start + (i + 1) * 8);
+    }
+  }
+
+  // spawned cores start at a constant moved into R3 earlier in the same block
+  bool r3_known = false;
+  unsigned int r3 = 0;
+  for (unsigned int i = 0; i < slots; i++) {
+    auto inst = code[i];
+    if (leaders.count(code_start + i * 8)) {
+      r3_known = false;
+    }
+    if (!valid[i]) {
+      continue;
+    }
+    if (inst.operation == TRP) {
+      if (inst.immediate == 100 && r3_known && is_slot(r3)) {
+        roots.push_back(r3);
+      }
+      if (traps_writing_r3.count(inst.immediate)) {
+        r3_known = false;
+      }
+    }
+    else if (writes_operand_1.count(inst.operation) && inst.operand_1 == R3) {
+      r3_known = inst.operation == MOVI || inst.operation == LDA;
+      r3 = inst.immediate;
+    }
+  }
+  leaders.insert(roots.begin(), roots.end());
+
+  std::map<unsigned int, unsigned int> block_at;
+  for (auto leader = leaders.begin(); leader != leaders.end(); leader++) {
+    BasicBlock block;
+    block.start = *leader;
+    block.end = std::next(leader) == leaders.end() ? code_end : *std::next(leader);
+    block_at[block.start] = cfg.blocks.size();
+    cfg.blocks.push_back(block);
+  }
+
+  std::vector<std::vector<unsigned int>> predecessors(cfg.blocks.size());
+  for (unsigned int b = 0; b < cfg.blocks.size(); b++) {
+    auto& block = cfg.blocks[b];
+    for (unsigned int address = block.start; address < block.end; address += 8) {
+      block.mix[mnemonic(code[(address - code_start) / 8])]++;
+    }
+
+    unsigned int last = (block.end - code_start) / 8 - 1;
+    Exit exit = exit_of(code[last], valid[last]);
+    block.invalid = !valid[last];
+    block.indirect = exit == Exit::INDIRECT;
+    if (exit == Exit::JUMP && is_slot(code[last].immediate)) {
+      block.successors.push_back(block_at[code[last].immediate]);
+    }
+    else if (exit == Exit::FALL_THROUGH && block.end < code_end) {
+      block.successors.push_back(b + 1);
+    }
+    for (unsigned int successor : block.successors) {
+      predecessors[successor].push_back(b);
+    }
+  }
+
+  // reachable from the entry or a spawned core's entry
+  std::vector<unsigned int> root_blocks;
+  for (unsigned int root : roots) {
+    root_blocks.push_back(block_at[root]);
+  }
+  std::vector<unsigned int> work = root_blocks;
+  for (unsigned int root : root_blocks) {
+    cfg.blocks[root].reachable = true;
+  }
+  while (!work.empty()) {
+    unsigned int b = work.back();
+    work.pop_back();
+    for (unsigned int successor : cfg.blocks[b].successors) {
+      if (!cfg.blocks[successor].reachable) {
+        cfg.blocks[successor].reachable = true;
+        work.push_back(successor);
+      }
+    }
+  }
+
+  // dominators of the reachable blocks, each root only dominated by itself
+  size_t count = cfg.blocks.size();
+  std::vector<std::vector<bool>> dominators(count, std::vector<bool>(count, true));
+  for (unsigned int root : root_blocks) {
+    dominators[root].assign(count, false);
+    dominators[root][root] = true;
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (unsigned int b = 0; b < count; b++) {
+      if (!cfg.blocks[b].reachable || std::count(root_blocks.begin(), root_blocks.end(), b)) {
+        continue;
+      }
+      std::vector<bool> dom(count, true);
+      for (unsigned int pred : predecessors[b]) {
+        if (cfg.blocks[pred].reachable) {
+          for (size_t i = 0; i < count; i++) {
+            dom[i] = dom[i] && dominators[pred][i];
+          }
+        }
+      }
+      dom[b] = true;
+      if (dom != dominators[b]) {
+        dominators[b] = dom;
+        changed = true;
+      }
+    }
+  }
+
+  // natural loops, merged by header
+  std::map<unsigned int, std::set<unsigned int>> loops;
+  for (unsigned int b = 0; b < count; b++) {
+    if (!cfg.blocks[b].reachable) {
+      continue;
+    }
+    for (unsigned int successor : cfg.blocks[b].successors) {
+      if (dominators[b][successor]) {
+        auto body = natural_loop(predecessors, successor, b);
+        loops[successor].insert(body.begin(), body.end());
+      }
+    }
+  }
+  for (auto& [header, body] : loops) {
+    Loop loop;
+    loop.header = header;
+    loop.blocks.assign(body.begin(), body.end());
+    // a loop is nested in every loop whose blocks include its own
+    loop.depth = 1;
+    for (auto& [other_header, other_body] : loops) {
+      if (other_header != header && std::includes(other_body.begin(), other_body.end(), body.begin(), body.end())) {
+        loop.depth++;
+      }
+    }
+    for (unsigned int b : body) {
+      cfg.blocks[b].loop_depth = std::max(cfg.blocks[b].loop_depth, loop.depth);
+    }
+    cfg.loops.push_back(loop);
+  }
+  return cfg;
+}
+
+static std::string block_flags(const BasicBlock& block) {
+  std::string flags;
+  if (!block.reachable) {
+    flags += " unreachable";
+  }
+  if (block.indirect) {
+    flags += " indirect";
+  }
+  if (block.invalid) {
+    flags += " invalid";
+  }
+  return flags;
+}
+
+void write_cfg_text(std::ostream& out, const ControlFlowGraph& cfg, const SymbolTable* symbols) {
+  out << "entry " << cfg.entry << "\n";
+  for (unsigned int b = 0; b < cfg.blocks.size(); b++) {
+    auto& block = cfg.blocks[b];
+    out << "\nblock B" << b << " " << block.start << "-" << block.end << " " << (block.end - block.start) / 8
+        << " instructions, loop depth " << block.loop_depth << block_flags(block) << "\n";
+    for (unsigned int address = block.start; address < block.end; address += 8) {
+      if (const Symbol* label = label_at(symbols, address)) {
+        out << label->name << ":\n";
+      }
+      out << "  " << address << "\t" << disassemble(decode_instruction(prog_mem + address), symbols) << "\n";
+    }
+
+    out << "  successors";
+    for (unsigned int successor : block.successors) {
+      out << " B" << successor;
+    }
+    out << "\n  mix";
+    for (auto mix = block.mix.begin(); mix != block.mix.end(); mix++) {
+      out << (mix == block.mix.begin() ? " " : ", ") << mix->first << " " << mix->second;
+    }
+    out << "\n";
+  }
+
+  out << "\nloops\n";
+  for (auto& loop : cfg.loops) {
+    out << "  header B" << loop.header << " depth " << loop.depth << " blocks";
+    for (unsigned int b : loop.blocks) {
+      out << " B" << b;
+    }
+    out << "\n";
+  }
+  out << "unreachable";
+  for (unsigned int b = 0; b < cfg.blocks.size(); b++) {
+    if (!cfg.blocks[b].reachable) {
+      out << " B" << b;
+    }
+  }
+  out << "\n";
+}
+
+static std::string dot_escape(const std::string& text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+  return escaped;
+}
+
+void write_cfg_dot(std::ostream& out, const ControlFlowGraph& cfg, const SymbolTable* symbols) {
+  out << "digraph cfg {\n  node [shape=box, fontname=\"monospace\"];\n";
+  for (unsigned int b = 0; b < cfg.blocks.size(); b++) {
+    auto& block = cfg.blocks[b];
+    out << "  B" << b << " [label=\"B" << b << " @" << block.start << dot_escape(block_flags(block)) << "\\l";
+    for (unsigned int address = block.start; address < block.end; address += 8) {
+      if (const Symbol* label = label_at(symbols, address)) {
+        out << dot_escape(label->name) << ":\\l";
+      }
+      out << "  " << dot_escape(disassemble(decode_instruction(prog_mem + address), symbols)) << "\\l";
+    }
+    out << "\"" << (block.reachable ? "" : ", style=dashed") << "];\n";
+  }
+  for (unsigned int b = 0; b < cfg.blocks.size(); b++) {
+    for (unsigned int successor : cfg.blocks[b].successors) {
+      out << "  B" << b << " -> B" << successor << ";\n";
+    }
+  }
+  out << "}\n";
+}
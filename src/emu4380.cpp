@@ -1,95 +1,163 @@
 #include "../include/emu4380.h"
+#include "../include/heap.h"
+#include "../include/predecode.h"
+#include "../include/smp.h"
+#include "../include/trace_cache.h"
 #include <algorithm>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <sys/mman.h>
 #include <vector>
 
 unsigned int MEM_SIZE = 0b1 << 17;
 
-unsigned int reg_file[22] = {0};
+thread_local unsigned int reg_file[22] = {0};
 unsigned char* prog_mem = 0;
-unsigned int cntrl_regs[5] = {0};
-
-PostOpFlag flag = NOTHING;
+unsigned char* mem_dirty = nullptr;
+thread_local unsigned int cntrl_regs[5] = {0};
+
+thread_local PostOpFlag flag = NOTHING;
+
+thread_local void (*jump_hook)(unsigned int target) = nullptr;
+
+std::uint64_t instruction_counts[256] = {0};
+unsigned char* coverage_map = nullptr;
+
+// Compile-time options for the emulator loop. Each combination is its own
+// instantiation of step() and the handlers below, so an option that is off
+// costs nothing per instruction.
+//   CheckedMemory  loads and stores check their address. Off only for
+//                  predecoded instructions whose address was checked then.
+//   JumpHook       JMP calls jump_hook if it is set
+//   Trace          every instruction is written to stderr before it runs
+//   Counters       executed instructions are counted per operation
+//   Coverage       executed instruction slots are marked in coverage_map
+template <bool CheckedMemory, bool JumpHook, bool Trace, bool Counters, bool Coverage>
+struct ExecPolicy {
+  static constexpr bool checked_memory = CheckedMemory;
+  static constexpr bool jump_hook = JumpHook;
+  static constexpr bool trace = Trace;
+  static constexpr bool counters = Counters;
+  static constexpr bool coverage = Coverage;
+};
+
+// the plain functions (step(), execute(), jmp(), ...) behave like this
+using DefaultPolicy = ExecPolicy<true, true, false, false, false>;
+
+template <class Policy>
+using Unchecked = ExecPolicy<false, Policy::jump_hook, Policy::trace, Policy::counters, Policy::coverage>;
 
 bool validate_address(unsigned int address, unsigned int size = 4) {
   return address <= MEM_SIZE - size;
 }
 
-bool jmp() {
+// like validate_address, but for a length that may exceed memory
+bool validate_range(unsigned int address, unsigned int length) {
+  return length <= MEM_SIZE && address <= MEM_SIZE - length;
+}
+
+template <class Policy>
+bool jmp(Instruction inst) {
   // can't jump to the last 7 bytes of program memory (or beyond)
-  if (!validate_address(cntrl_regs[IMMEDIATE], 8)) {
+  if (!validate_address(inst.immediate, 8)) {
     return false;
   }
 
-  reg_file[PC] = cntrl_regs[IMMEDIATE];
+  reg_file[PC] = inst.immediate;
+  if (Policy::jump_hook && jump_hook) {
+    jump_hook(inst.immediate);
+  }
   return true;
 }
 
-bool mov() {
-  auto r_src = cntrl_regs[OPERAND_2];
-  auto r_dest = cntrl_regs[OPERAND_1];
+bool jmp(Instruction inst) {
+  return jmp<DefaultPolicy>(inst);
+}
+
+bool mov(Instruction inst) {
+  auto r_src = inst.operand_2;
+  auto r_dest = inst.operand_1;
 
   reg_file[r_dest] = reg_file[r_src];  
   return true;
 }
 
-bool movi() {
-  auto r_dest = cntrl_regs[OPERAND_1];
+bool movi(Instruction inst) {
+  auto r_dest = inst.operand_1;
 
-  reg_file[r_dest] = cntrl_regs[IMMEDIATE];
+  reg_file[r_dest] = inst.immediate;
   return true;
 }
 
-bool lda() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto address = cntrl_regs[IMMEDIATE];
+bool lda(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto address = inst.immediate;
 
   reg_file[r_dest] = address;
   return true;
 }
 
-bool str() {
-  auto r_src = cntrl_regs[OPERAND_1];
-  auto address = cntrl_regs[IMMEDIATE];
+template <class Policy>
+bool str(Instruction inst) {
+  auto r_src = inst.operand_1;
+  auto address = inst.immediate;
 
-  if (!validate_address(address)) {
+  if (Policy::checked_memory && !validate_address(address)) {
     return false;
   }
 
-  *(unsigned int*)(prog_mem + address) = reg_file[r_src];
+  store_word(prog_mem + address, reg_file[r_src]);
+  mark_dirty(address, 4);
   return true;
 }
 
-bool ldr() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto address = cntrl_regs[IMMEDIATE];
+bool str(Instruction inst) {
+  return str<DefaultPolicy>(inst);
+}
+
+template <class Policy>
+bool ldr(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto address = inst.immediate;
 
-  if (!validate_address(address)) {
+  if (Policy::checked_memory && !validate_address(address)) {
     return false;
   }
 
-  reg_file[r_dest] = *(unsigned int*)(prog_mem + address);
+  reg_file[r_dest] = load_word(prog_mem + address);
   return true;
 }
 
-bool stb() {
-  auto r_src = cntrl_regs[OPERAND_1];
-  auto address = cntrl_regs[IMMEDIATE];
+bool ldr(Instruction inst) {
+  return ldr<DefaultPolicy>(inst);
+}
+
+template <class Policy>
+bool stb(Instruction inst) {
+  auto r_src = inst.operand_1;
+  auto address = inst.immediate;
 
-  if (!validate_address(address, 1)) {
+  if (Policy::checked_memory && !validate_address(address, 1)) {
     return false;
   }
 
   prog_mem[address] = (unsigned char)(reg_file[r_src] & 0x000000FF);
+  mark_dirty(address, 1);
   return true;
 }
 
-bool ldb() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto address = cntrl_regs[IMMEDIATE];
+bool stb(Instruction inst) {
+  return stb<DefaultPolicy>(inst);
+}
+
+template <class Policy>
+bool ldb(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto address = inst.immediate;
 
-  if (!validate_address(address, 1)) {
+  if (Policy::checked_memory && !validate_address(address, 1)) {
     return false;
   }
 
@@ -97,64 +165,68 @@ bool ldb() {
   return true;
 }
 
-bool add() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto r_src1 = cntrl_regs[OPERAND_2];
-  auto r_src2 = cntrl_regs[OPERAND_3];
+bool ldb(Instruction inst) {
+  return ldb<DefaultPolicy>(inst);
+}
+
+bool add(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto r_src1 = inst.operand_2;
+  auto r_src2 = inst.operand_3;
 
   reg_file[r_dest] = reg_file[r_src1] + reg_file[r_src2];
   return true;
 }
 
-bool addi() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto r_src1 = cntrl_regs[OPERAND_2];
-  auto immed = cntrl_regs[IMMEDIATE];
+bool addi(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto r_src1 = inst.operand_2;
+  auto immed = inst.immediate;
 
   reg_file[r_dest] = reg_file[r_src1] + immed;
   return true;
 }
 
-bool sub() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto r_src1 = cntrl_regs[OPERAND_2];
-  auto r_src2 = cntrl_regs[OPERAND_3];
+bool sub(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto r_src1 = inst.operand_2;
+  auto r_src2 = inst.operand_3;
 
   reg_file[r_dest] = reg_file[r_src1] - reg_file[r_src2];
   return true;
 }
 
-bool subi() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto r_src1 = cntrl_regs[OPERAND_2];
-  auto immed = cntrl_regs[IMMEDIATE];
+bool subi(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto r_src1 = inst.operand_2;
+  auto immed = inst.immediate;
 
   reg_file[r_dest] = reg_file[r_src1] - immed;
   return true;
 }
 
-bool mul() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto r_src1 = cntrl_regs[OPERAND_2];
-  auto r_src2 = cntrl_regs[OPERAND_3];
+bool mul(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto r_src1 = inst.operand_2;
+  auto r_src2 = inst.operand_3;
 
   reg_file[r_dest] = reg_file[r_src1] * reg_file[r_src2];
   return true;
 }
 
-bool muli() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto r_src1 = cntrl_regs[OPERAND_2];
-  auto immed = cntrl_regs[IMMEDIATE];
+bool muli(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto r_src1 = inst.operand_2;
+  auto immed = inst.immediate;
 
   reg_file[r_dest] = reg_file[r_src1] * immed;
   return true;
 }
 
-bool div() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto r_src1 = cntrl_regs[OPERAND_2];
-  auto r_src2 = cntrl_regs[OPERAND_3];
+bool div(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto r_src1 = inst.operand_2;
+  auto r_src2 = inst.operand_3;
 
   // can't divide by zero
   if (reg_file[r_src2] == 0) {
@@ -165,10 +237,10 @@ bool div() {
   return true;
 }
 
-bool sdiv() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto r_src1 = cntrl_regs[OPERAND_2];
-  auto r_src2 = cntrl_regs[OPERAND_3];
+bool sdiv(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto r_src1 = inst.operand_2;
+  auto r_src2 = inst.operand_3;
 
   // can't divide by zero
   if (reg_file[r_src2] == 0) {
@@ -179,10 +251,10 @@ bool sdiv() {
   return true;
 }
 
-bool divi() {
-  auto r_dest = cntrl_regs[OPERAND_1];
-  auto r_src1 = cntrl_regs[OPERAND_2];
-  auto immed = cntrl_regs[IMMEDIATE];
+bool divi(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto r_src1 = inst.operand_2;
+  auto immed = inst.immediate;
 
   // can't divide by zero
   if (immed == 0) {
@@ -194,6 +266,63 @@ bool divi() {
   return true;
 }
 
+// Atomic operations need a naturally aligned word so the host can operate on
+// it directly. Guest memory is little endian, so big endian hosts swap the
+// values going in and out.
+static unsigned int* atomic_word(unsigned int address) {
+  if (address % 4 != 0 || !validate_address(address)) {
+    return nullptr;
+  }
+  mark_dirty(address, 4);
+  return (unsigned int*)(prog_mem + address);
+}
+
+static unsigned int guest_order(unsigned int word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return __builtin_bswap32(word);
+#else
+  return word;
+#endif
+}
+
+bool cas(Instruction inst) {
+  auto r_expected = inst.operand_1;
+  auto r_src = inst.operand_2;
+  unsigned int* word = atomic_word(inst.immediate);
+
+  if (word == nullptr) {
+    return false;
+  }
+
+  // on failure `expected` is updated to the current value
+  unsigned int expected = guest_order(reg_file[r_expected]);
+  __atomic_compare_exchange_n(word, &expected, guest_order(reg_file[r_src]), false,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  reg_file[r_expected] = guest_order(expected);
+  return true;
+}
+
+bool faa(Instruction inst) {
+  auto r_dest = inst.operand_1;
+  auto r_src = inst.operand_2;
+  unsigned int* word = atomic_word(inst.immediate);
+
+  if (word == nullptr) {
+    return false;
+  }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  unsigned int old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+  while (!__atomic_compare_exchange_n(word, &old, guest_order(guest_order(old) + reg_file[r_src]),
+                                      false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+  }
+  reg_file[r_dest] = guest_order(old);
+#else
+  reg_file[r_dest] = __atomic_fetch_add(word, reg_file[r_src], __ATOMIC_SEQ_CST);
+#endif
+  return true;
+}
+
 bool trp0() {
   flag = TERMINATE;
   return true;
@@ -248,11 +377,100 @@ bool trp98() {
   return true;
 }
 
-bool trp() {
-  auto immed = cntrl_regs[IMMEDIATE];
+bool trp100() {
+  unsigned int core_id;
+  if (!spawn_core(reg_file[R3], reg_file[R4], core_id)) {
+    core_id = 0xFFFFFFFF;
+  }
+  reg_file[R3] = core_id;
+  return true;
+}
+
+bool trp101() {
+  reg_file[R3] = join_core(reg_file[R3]) ? 0 : 0xFFFFFFFF;
+  return true;
+}
+
+// Block memory traps. Both ranges are checked once up front and the work is
+// done by the host's (vectorized) memmove/memset/memcmp.
+bool trp102() {
+  auto dest = reg_file[R3];
+  auto src = reg_file[R4];
+  auto length = reg_file[R5];
+
+  if (!validate_range(dest, length) || !validate_range(src, length)) {
+    return false;
+  }
+
+  std::memmove(prog_mem + dest, prog_mem + src, length);
+  mark_dirty(dest, length);
+  return true;
+}
+
+bool trp103() {
+  auto dest = reg_file[R3];
+  auto length = reg_file[R5];
+
+  if (!validate_range(dest, length)) {
+    return false;
+  }
+
+  std::memset(prog_mem + dest, reg_file[R4] & 0xFF, length);
+  mark_dirty(dest, length);
+  return true;
+}
+
+bool trp104() {
+  auto first = reg_file[R3];
+  auto second = reg_file[R4];
+  auto length = reg_file[R5];
+
+  if (!validate_range(first, length) || !validate_range(second, length)) {
+    return false;
+  }
+
+  int result = std::memcmp(prog_mem + first, prog_mem + second, length);
+  reg_file[R3] = result < 0 ? -1 : (result > 0 ? 1 : 0);
+  return true;
+}
+
+// Prints the length prefixed string (as laid out by .STR) at R3 in one write.
+bool trp105() {
+  auto addr = reg_file[R3];
+  if (!validate_address(addr, 1)) {
+    return false;
+  }
+
+  unsigned int length = prog_mem[addr];
+  if (!validate_range(addr + 1, length)) {
+    return false;
+  }
+
+  std::cout.write(reinterpret_cast<const char*>(prog_mem + addr + 1), length);
+  return true;
+}
+
+// Heap traps (see heap.h). The allocator checks the block against memory.
+bool trp106() {
+  unsigned int address;
+  reg_file[R3] = heap_alloc(reg_file[R3], address) ? address : 0xFFFFFFFF;
+  return true;
+}
+
+bool trp107() {
+  reg_file[R3] = heap_free(reg_file[R3]) ? 0 : 0xFFFFFFFF;
+  return true;
+}
+
+bool valid_trp(unsigned int immed) {
+  return immed <= 4 || immed == 98 || (immed >= 100 && immed <= 107);
+}
+
+bool trp(Instruction inst) {
+  auto immed = inst.immediate;
 
   // validate immediate
-  if (!(immed <= 4 || immed == 98)) {
+  if (!valid_trp(immed)) {
     return false;
   }
 
@@ -269,42 +487,202 @@ bool trp() {
       return trp4();
     case 98:
       return trp98();
+    case 100:
+      return trp100();
+    case 101:
+      return trp101();
+    case 102:
+      return trp102();
+    case 103:
+      return trp103();
+    case 104:
+      return trp104();
+    case 105:
+      return trp105();
+    case 106:
+      return trp106();
+    case 107:
+      return trp107();
     default:
       std::cout << "TRP error! Invalid immediate value not detected.";
       throw "Can't handle invalid trp code not detected!";
   }
 }
 
-bool init_mem(unsigned int size) {
-  prog_mem = new unsigned char[size];
+// the current arena: guest memory followed by its dirty page map
+static unsigned char* arena = nullptr;
+static size_t arena_length = 0;
+static unsigned int arena_size = 0;
+
+static size_t page_count(unsigned int size) {
+  return ((size_t)size + (1u << MEM_PAGE_SHIFT) - 1) >> MEM_PAGE_SHIFT;
+}
+
+HugePageMode huge_page_mode = HUGE_PAGES_AUTO;
+bool mem_huge_pages = false;
+
+static bool want_huge_pages(unsigned int size) {
+  if (huge_page_mode == HUGE_PAGES_AUTO) {
+    return size >= HUGE_PAGE_AUTO_SIZE;
+  }
+  return huge_page_mode == HUGE_PAGES_ON && size >= HUGE_PAGE_SIZE;
+}
+
+// Maps a whole number of huge pages starting on a huge page boundary by
+// over-allocating and unmapping the ends, then asks for transparent huge
+// pages. Returns nullptr if the mapping fails.
+static unsigned char* map_huge(size_t& length, int flags) {
+  length = (length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  size_t padded = length + HUGE_PAGE_SIZE;
+  // populated after the advice, or it would be faulted in as small pages
+  void* memory = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | (flags & ~MAP_POPULATE), -1, 0);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  auto start = (std::uintptr_t)memory;
+  auto aligned = (start + HUGE_PAGE_SIZE - 1) & ~(std::uintptr_t)(HUGE_PAGE_SIZE - 1);
+  if (aligned > start) {
+    munmap(memory, aligned - start);
+  }
+  if (padded - (aligned - start) > length) {
+    munmap((void*)(aligned + length), padded - (aligned - start) - length);
+  }
+
+  auto huge = (unsigned char*)aligned;
+#ifdef MADV_HUGEPAGE
+  mem_huge_pages = madvise(huge, length, MADV_HUGEPAGE) == 0;
+#endif
+  if (flags & MAP_POPULATE) {
+    for (size_t offset = 0; offset < length; offset += 1u << MEM_PAGE_SHIFT) {
+      ((volatile unsigned char*)huge)[offset] = 0;
+    }
+  }
+  return huge;
+}
+
+// anonymous mappings are zeroed by the kernel, page by page as first touched
+static bool map_arena(unsigned int size, int flags) {
+  free_mem();
+
+  size_t pages = page_count(size);
+  size_t memory_length = pages << MEM_PAGE_SHIFT;
+  unsigned char* memory = nullptr;
+  size_t length = 0;
+  if (want_huge_pages(size)) {
+    // guest memory fills whole huge pages, the dirty map goes after them
+    memory_length = (memory_length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    length = memory_length + pages;
+    memory = map_huge(length, flags);
+  }
+
+  // normal pages if huge pages aren't wanted or couldn't be mapped
+  if (memory == nullptr) {
+    memory_length = pages << MEM_PAGE_SHIFT;
+    length = std::max<size_t>(memory_length + pages, 1);
+    void* mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | flags, -1, 0);
+    if (mapped == MAP_FAILED) {
+      return false;
+    }
+    memory = (unsigned char*)mapped;
+  }
+
+  arena = memory;
+  arena_length = length;
+  arena_size = size;
+  prog_mem = arena;
+  mem_dirty = arena + memory_length;
   MEM_SIZE = size;
   return true;
 }
 
+bool init_mem(unsigned int size) {
+  clear_predecode();
+
+  if (arena != nullptr && prog_mem == arena && arena_size == size) {
+    reset_mem();
+    MEM_SIZE = size;
+    return true;
+  }
+  return map_arena(size, MAP_PRIVATE);
+}
+
+bool init_shared_mem(unsigned int size) {
+  clear_predecode();
+  return map_arena(size, MAP_SHARED | MAP_POPULATE);
+}
+
+void reset_mem() {
+  size_t pages = page_count(arena_size);
+  for (size_t page = 0; page < pages; page++) {
+    if (mem_dirty[page]) {
+      size_t start = page << MEM_PAGE_SHIFT;
+      std::memset(arena + start, 0, std::min<size_t>(1u << MEM_PAGE_SHIFT, arena_size - start));
+      mem_dirty[page] = 0;
+    }
+  }
+}
+
+void free_mem() {
+  if (arena != nullptr) {
+    munmap(arena, arena_length);
+  }
+  if (prog_mem == arena) {
+    prog_mem = nullptr;
+  }
+  arena = nullptr;
+  arena_length = 0;
+  arena_size = 0;
+  mem_dirty = nullptr;
+  mem_huge_pages = false;
+}
+
 // bool fetch(); // Retrieves the bytes for the current instruction and places
 // them in the appropriate cntrl_regs. Also increments the PC to point to the
 // next instruction. If an invalid fetch address (i.e. out of bounds) is
 // encountered by this funcLon it shall return false. Otherwise it shall return
 // true
 bool fetch() {
-  // check that PC is within program memory
-  if (reg_file[PC] > MEM_SIZE - 8) {
+  Instruction inst;
+  if (!fetch(inst)) {
     return false;
   }
 
+  // load instruction into control registers
+  cntrl_regs[OPERATION] = inst.operation;
+  cntrl_regs[OPERAND_1] = inst.operand_1;
+  cntrl_regs[OPERAND_2] = inst.operand_2;
+  cntrl_regs[OPERAND_3] = inst.operand_3;
+  cntrl_regs[IMMEDIATE] = inst.immediate;
+  return true;
+}
+
+// Same as fetch(), but hands the instruction back by value instead of
+// storing it in cntrl_regs.
+bool fetch(Instruction& inst) {
   auto load_addr = reg_file[PC];
 
-  // load memory into control registers
-  cntrl_regs[OPERATION] = prog_mem[load_addr];
-  cntrl_regs[OPERAND_1] = prog_mem[load_addr + 1];
-  cntrl_regs[OPERAND_2] = prog_mem[load_addr + 2];
-  cntrl_regs[OPERAND_3] = prog_mem[load_addr + 3];
-  // cast to unsigned int pointer and dereference (assumes little endian environment)
-  cntrl_regs[IMMEDIATE] = *(unsigned int*)(prog_mem + load_addr + 4);
-                          
+  // check that PC is within program memory
+  if (load_addr > MEM_SIZE - 8) {
+    return false;
+  }
+
+  inst = decode_instruction(prog_mem + load_addr);
+
   // increment PC and return true
-  reg_file[PC] += 8;
-    return true;
+  reg_file[PC] = load_addr + 8;
+  return true;
+}
+
+// builds an Instruction from the values currently in cntrl_regs
+static Instruction cntrl_regs_instruction() {
+  Instruction inst;
+  inst.operation = (unsigned char)cntrl_regs[OPERATION];
+  inst.operand_1 = (unsigned char)cntrl_regs[OPERAND_1];
+  inst.operand_2 = (unsigned char)cntrl_regs[OPERAND_2];
+  inst.operand_3 = (unsigned char)cntrl_regs[OPERAND_3];
+  inst.immediate = cntrl_regs[IMMEDIATE];
+  return inst;
 }
 
 // This function shall verify that the specified operation (or
@@ -314,25 +692,36 @@ bool fetch() {
 // instruction with an RD value of 55 would clearly be a malformed
 // instruction.
 bool decode() {
-  // validate operation (1, 7-13, 18-26, 31)
-  auto op = cntrl_regs[OPERATION];
+  // operation and operands wider than a byte can't come from memory
+  if (cntrl_regs[OPERATION] > 0xFF || cntrl_regs[OPERAND_1] > 0xFF ||
+      cntrl_regs[OPERAND_2] > 0xFF || cntrl_regs[OPERAND_3] > 0xFF) {
+    return false;
+  }
+
+  return decode(cntrl_regs_instruction());
+}
+
+bool decode(Instruction inst) {
+  // validate operation (1, 7-13, 18-26, 31, 40-41)
+  unsigned int op = inst.operation;
   if (!(op == 1 ||
      (op >= 7 && op <= 13) ||
      (op >= 18 && op <= 26) ||
-      op == 31)) {
+      op == 31 ||
+      op == 40 || op == 41)) {
     return false;
   }
 
-  // read operands from control registers
-  auto op1 = cntrl_regs[OPERAND_1];
-  auto op2 = cntrl_regs[OPERAND_2];
-  auto op3 = cntrl_regs[OPERAND_3];
+  // read operands from the instruction
+  unsigned int op1 = inst.operand_1;
+  unsigned int op2 = inst.operand_2;
+  unsigned int op3 = inst.operand_3;
 
   // validate trp immediate value
   if (op == 31) {
-    unsigned int imm = cntrl_regs[IMMEDIATE];
+    unsigned int imm = inst.immediate;
 
-    if (!(imm <= 4 || imm == 98)) {
+    if (!valid_trp(imm)) {
       return false;
     }
   }
@@ -364,43 +753,52 @@ bool decode() {
 }
 
 bool execute() {
-  switch(cntrl_regs[OPERATION]) {
+  return execute(cntrl_regs_instruction());
+}
+
+template <class Policy>
+bool execute(Instruction inst) {
+  switch(inst.operation) {
     case JMP:
-      return jmp();
+      return jmp<Policy>(inst);
     case MOV:
-      return mov();
+      return mov(inst);
     case MOVI:
-      return movi();
+      return movi(inst);
     case LDA:
-      return lda();
+      return lda(inst);
     case STR:
-      return str();
+      return str<Policy>(inst);
     case LDR:
-      return ldr();
+      return ldr<Policy>(inst);
     case STB:
-      return stb();
+      return stb<Policy>(inst);
     case LDB:
-      return ldb();
+      return ldb<Policy>(inst);
     case ADD:
-      return add();
+      return add(inst);
     case ADDI:
-      return addi();
+      return addi(inst);
     case SUB:
-      return sub();
+      return sub(inst);
     case SUBI:
-      return subi();
+      return subi(inst);
     case MUL:
-      return mul();
+      return mul(inst);
     case MULI:
-      return muli();
+      return muli(inst);
     case DIV:
-      return div();
+      return div(inst);
     case SDIV:
-      return sdiv();
+      return sdiv(inst);
     case DIVI:
-      return divi();        
+      return divi(inst);
     case TRP:
-      return trp();
+      return trp(inst);
+    case CAS:
+      return cas(inst);
+    case FAA:
+      return faa(inst);
     default:
       std::cout << "execute() called with invalid operation!";
       throw "Can't handle invalid operation!";
@@ -409,10 +807,161 @@ bool execute() {
   return false;
 }
 
+bool execute(Instruction inst) {
+  return execute<DefaultPolicy>(inst);
+}
+
+template <class Policy>
+static void observe(unsigned int address, Instruction inst) {
+  if (Policy::trace) {
+    std::fprintf(stderr, "TRACE %u: %u %u %u %u %u\n", address, inst.operation, inst.operand_1,
+                 inst.operand_2, inst.operand_3, inst.immediate);
+  }
+  if (Policy::counters) {
+    __atomic_fetch_add(&instruction_counts[inst.operation], 1, __ATOMIC_RELAXED);
+  }
+  if (Policy::coverage) {
+    // a plain store, relaxed so cores marking the same slot don't race
+    __atomic_store_n(&coverage_map[address >> 3], 1, __ATOMIC_RELAXED);
+  }
+}
+
+template <class Policy>
+static bool run_predecoded(const Predecoded& entry) {
+  if (entry.plan != ArithPlan::NONE) {
+    return execute_plan(entry);
+  }
+  if (entry.address_checked) {
+    return execute<Unchecked<Policy>>(entry.inst);
+  }
+  return execute<Policy>(entry.inst);
+}
+
+template <class Policy>
+static bool step(unsigned int address) {
+  // instructions that were decoded at load time skip fetch and decode
+  if (auto entry = find_predecoded(address)) {
+    observe<Policy>(address, entry->inst);
+    reg_file[PC] = address + 8;
+    return run_predecoded<Policy>(*entry);
+  }
+
+  Instruction inst;
+  if (!fetch(inst)) {
+    return false;
+  }
+  observe<Policy>(address, inst);
+  return decode(inst) && execute<Policy>(inst);
+}
+
+bool step() {
+  return step<DefaultPolicy>(reg_file[PC]);
+}
+
+// Runs a hot trace (see trace_cache.h) until a guard fails or a step changes
+// its code. False if an instruction fails.
+template <class Policy>
+static bool replay(const HotTrace& trace, unsigned int& failed_address) {
+  while (true) {
+    for (auto& step : trace.steps) {
+      observe<Policy>(step.address, step.entry->inst);
+      reg_file[PC] = step.address + 8;
+      if (!run_predecoded<Policy>(*step.entry)) {
+        failed_address = step.address;
+        return false;
+      }
+      if (step.guard && reg_file[PC] != step.next) {
+        return true;
+      }
+      for (unsigned int i = 0; i < step.rewrite_count; i++) {
+        if (find_predecoded(step.rewrites[i]) == nullptr) {
+          return true;
+        }
+      }
+    }
+  }
+}
+
+template <class Policy>
+static bool run(unsigned int& failed_address) {
+  // other cores could change the code under a trace while it runs
+  bool traces = hot_traces_enabled && max_cores == 1;
+  bool recording = false;
+  bool jumped = false;
+  while (flag != TERMINATE) {
+    unsigned int address = reg_file[PC];
+    if (traces && jumped && !recording) {
+      const HotTrace* trace = jumped_to(address, recording);
+      if (recording) {
+        begin_trace(address);
+      }
+      else if (trace != nullptr) {
+        if (!replay<Policy>(*trace, failed_address)) {
+          return false;
+        }
+        // wherever the trace stopped counts as a jump target
+        continue;
+      }
+    }
+    if (recording) {
+      recording = record_step(address);
+    }
+
+    if (!step<Policy>(address)) {
+      failed_address = address;
+      return false;
+    }
+    jumped = reg_file[PC] != address + 8;
+  }
+  return true;
+}
+
+RunLoop run_loop = run<ExecPolicy<true, false, false, false, false>>;
+
+// turns the runtime options, one at a time, into template arguments
+template <bool... Chosen>
+static RunLoop select_options() {
+  return run<ExecPolicy<true, Chosen...>>;
+}
+
+template <bool... Chosen, typename... Rest>
+static RunLoop select_options(bool next, Rest... rest) {
+  return next ? select_options<Chosen..., true>(rest...) : select_options<Chosen..., false>(rest...);
+}
+
+RunLoop select_run_loop(bool jump_hook, bool trace, bool counters, bool coverage) {
+  return select_options<>(jump_hook, trace, counters, coverage);
+}
+
+void write_instruction_counts(std::ostream& out) {
+  static const std::pair<unsigned int, const char*> names[] = {
+    {JMP, "JMP"}, {MOV, "MOV"}, {MOVI, "MOVI"}, {LDA, "LDA"}, {STR, "STR"}, {LDR, "LDR"},
+    {STB, "STB"}, {LDB, "LDB"}, {ADD, "ADD"}, {ADDI, "ADDI"}, {SUB, "SUB"}, {SUBI, "SUBI"},
+    {MUL, "MUL"}, {MULI, "MULI"}, {DIV, "DIV"}, {SDIV, "SDIV"}, {DIVI, "DIVI"}, {TRP, "TRP"},
+    {CAS, "CAS"}, {FAA, "FAA"}};
+
+  std::vector<std::pair<std::uint64_t, const char*>> counts;
+  std::uint64_t total = 0;
+  for (auto& name : names) {
+    auto count = __atomic_load_n(&instruction_counts[name.first], __ATOMIC_RELAXED);
+    if (count > 0) {
+      counts.push_back({count, name.second});
+    }
+    total += count;
+  }
+  std::stable_sort(counts.begin(), counts.end(),
+                   [](const auto& a, const auto& b) { return a.first > b.first; });
+
+  out << "instructions\t" << total << "\n";
+  for (auto& count : counts) {
+    out << count.second << "\t" << count.first << "\n";
+  }
+}
+
 // convenience categorization of operations
 std::vector<unsigned int> operations_0operand_3dc = {1, 31};
 std::vector<unsigned int> operations_1operand_2dc = {8, 9, 10, 11, 12, 13};
-std::vector<unsigned int> operations_2operand_1dc = {7, 19, 21, 23, 26};
+std::vector<unsigned int> operations_2operand_1dc = {7, 19, 21, 23, 26, 40, 41};
 std::vector<unsigned int> operations_3operand_0dc = {18, 20, 22, 24, 25};
 
 bool parse_unsigned_int(std::string input, unsigned int &output) {
@@ -0,0 +1,78 @@
+#include "../include/heap.h"
+#include "../include/emu4380.h"
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// size class k holds blocks of 1 << k bytes
+static const unsigned int MIN_CLASS = 3;
+static const unsigned int CLASSES = 32;
+
+static std::mutex heap_lock;
+static unsigned int heap_top = 0;
+static std::vector<unsigned int> free_blocks[CLASSES];
+// allocated block -> its size class
+static std::unordered_map<unsigned int, unsigned char> live_blocks;
+
+static unsigned int size_class(unsigned int size) {
+  unsigned int k = MIN_CLASS;
+  while (k < CLASSES && (1ull << k) < size) {
+    k++;
+  }
+  return k;
+}
+
+void init_heap(unsigned int start) {
+  std::lock_guard<std::mutex> lock(heap_lock);
+  heap_top = (unsigned int)(((unsigned long long)start + HEAP_MIN_BLOCK - 1) & ~(unsigned long long)(HEAP_MIN_BLOCK - 1));
+  for (auto& blocks : free_blocks) {
+    blocks.clear();
+  }
+  live_blocks.clear();
+  reg_file[HP] = heap_top;
+}
+
+bool heap_alloc(unsigned int size, unsigned int& address) {
+  std::lock_guard<std::mutex> lock(heap_lock);
+  unsigned int k = size_class(size);
+  if (k >= CLASSES) {
+    return false;
+  }
+
+  if (!free_blocks[k].empty()) {
+    address = free_blocks[k].back();
+    free_blocks[k].pop_back();
+  }
+  else {
+    unsigned long long end = (unsigned long long)heap_top + (1ull << k);
+    if (end > MEM_SIZE) {
+      return false;
+    }
+    address = heap_top;
+    heap_top = (unsigned int)end;
+  }
+
+  live_blocks[address] = k;
+  reg_file[HP] = heap_top;
+  return true;
+}
+
+bool heap_free(unsigned int address) {
+  std::lock_guard<std::mutex> lock(heap_lock);
+  auto block = live_blocks.find(address);
+  if (block == live_blocks.end()) {
+    return false;
+  }
+
+  unsigned int k = block->second;
+  live_blocks.erase(block);
+  if ((unsigned long long)address + (1ull << k) == heap_top) {
+    heap_top = address;
+  }
+  else {
+    free_blocks[k].push_back(address);
+  }
+  reg_file[HP] = heap_top;
+  return true;
+}
@@ -0,0 +1,131 @@
+#include "../include/loader.h"
+#include "../include/emu4380.h"
+#include "../include/heap.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <utility>
+
+static const unsigned char V2_MAGIC[4] = {'4', '3', '8', '0'};
+static const unsigned int V2_HEADER_SIZE = 48;
+
+unsigned long long fnv1a_64(const unsigned char* data, size_t size, unsigned long long hash) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static bool read_exact(int fd, unsigned char* data, size_t size) {
+  while (size > 0) {
+    ssize_t count = read(fd, data, size);
+    if (count <= 0) {
+      return false;
+    }
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+bool read_framed_image(int fd, std::vector<unsigned char>& bytes) {
+  unsigned char length[4];
+  if (!read_exact(fd, length, 4)) {
+    return false;
+  }
+  bytes.resize(load_word(length));
+  return read_exact(fd, bytes.data(), bytes.size());
+}
+
+static unsigned int read_u16(const unsigned char* src) {
+  return src[0] | (src[1] << 8);
+}
+
+static bool parse_v1(ProgramImage& image) {
+  unsigned char entry[4] = {0};
+  std::memcpy(entry, image.bytes.data(), std::min<size_t>(image.bytes.size(), 4));
+
+  image.version = 1;
+  image.entry = load_word(entry);
+  image.end = image.bytes.size();
+  image.code_start = image.entry;
+  image.code_end = image.bytes.size();
+  image.segments.push_back({0, 0, (unsigned int)image.bytes.size()});
+  return true;
+}
+
+static bool parse_v2(ProgramImage& image, std::string& error) {
+  const unsigned char* header = image.bytes.data();
+  unsigned long long file_size = image.bytes.size();
+
+  if (read_u16(header + 6) != V2_HEADER_SIZE) {
+    error = "unsupported header size";
+    return false;
+  }
+
+  image.version = 2;
+  image.entry = load_word(header + 8);
+  Segment data = {load_word(header + 16), load_word(header + 12), load_word(header + 20)};
+  unsigned int bss_size = load_word(header + 24);
+  Segment code = {load_word(header + 32), load_word(header + 28), load_word(header + 36)};
+
+  // segments must lie in the file and in the layout the assembler produces
+  if ((unsigned long long)data.offset + data.size > file_size ||
+      (unsigned long long)code.offset + code.size > file_size) {
+    error = "segment extends past the end of the file";
+    return false;
+  }
+  if (data.address != 4 ||
+      (unsigned long long)data.address + data.size + bss_size != code.address) {
+    error = "invalid segment layout";
+    return false;
+  }
+
+  unsigned long long hash = fnv1a_64(header, 40);
+  hash = fnv1a_64(header + data.offset, data.size, hash);
+  hash = fnv1a_64(header + code.offset, code.size, hash);
+  unsigned long long stored_hash = load_word(header + 40) | (unsigned long long)load_word(header + 44) << 32;
+  if (hash != stored_hash) {
+    error = "content hash mismatch";
+    return false;
+  }
+
+  image.end = (unsigned long long)code.address + code.size;
+  image.code_start = code.address;
+  image.code_end = code.address + code.size;
+  image.segments.push_back(data);
+  image.segments.push_back(code);
+  return true;
+}
+
+bool parse_image(std::vector<unsigned char> bytes, ProgramImage& image, std::string& error) {
+  image.bytes = std::move(bytes);
+  image.segments.clear();
+
+  bool is_v2 = image.bytes.size() >= V2_HEADER_SIZE &&
+               std::memcmp(image.bytes.data(), V2_MAGIC, 4) == 0 &&
+               read_u16(image.bytes.data() + 4) == 2;
+  if (is_v2) {
+    return parse_v2(image, error);
+  }
+  return parse_v1(image);
+}
+
+void load_image(const ProgramImage& image) {
+  for (auto& segment : image.segments) {
+    std::memcpy(prog_mem + segment.address, image.bytes.data() + segment.offset, segment.size);
+    mark_dirty(segment.address, segment.size);
+  }
+
+  // version 2 keeps the entry in the header, put it where version 1 has it
+  if (image.version == 2) {
+    store_word(prog_mem, image.entry);
+    mark_dirty(0, 4);
+  }
+
+  // load first 4 bytes into PC register
+  reg_file[PC] = load_word(prog_mem);
+  init_heap((unsigned int)image.end);
+}
@@ -1,28 +1,78 @@
+#include <algorithm>
+#include <cstdlib>
 #include <fstream>
 #include <ios>
 #include <iostream>
 #include <iterator>
+#include <map>
+#include <thread>
+#include <unistd.h>
 #include <vector>
+#include "../include/coverage.h"
 #include "../include/emu4380.h"
+#include "../include/loader.h"
+#include "../include/predecode.h"
+#include "../include/profiler.h"
+#include "../include/result_cache.h"
+#include "../include/server.h"
+#include "../include/smp.h"
+#include "../include/sweep.h"
+#include "../include/symbols.h"
+#include "../include/trace_cache.h"
 
-void setup_memory(unsigned int mem_size, std::vector<unsigned char> program) {
-    if (program.size() > mem_size) {
+// Reads the binary from a path, or a framed image (see read_framed_image)
+// from stdin for "-" or from an inherited descriptor for "fd:<n>". The
+// program's input is whatever follows on stdin.
+bool read_program(const std::string& source, std::vector<unsigned char>& program) {
+    unsigned int fd = 0;
+    if (source == "-" || (source.rfind("fd:", 0) == 0 && parse_unsigned_int(source.substr(3), fd))) {
+        return read_framed_image(fd, program);
+    }
+
+    std::ifstream in_file(source, std::ios_base::binary);
+    auto begin = std::istreambuf_iterator<char>(in_file);
+    auto end = std::istreambuf_iterator<char>();
+    program.assign(begin, end);
+    return true;
+}
+
+// parses the binary and checks that it fits in mem_size bytes
+ProgramImage read_image(unsigned int mem_size, std::vector<unsigned char> program) {
+    ProgramImage image;
+    std::string error;
+    if (!parse_image(std::move(program), image, error)) {
+        std::cout << "INVALID BINARY: " << error << "\n";
+        std::cout << std::flush;
+        exit(6);
+    }
+
+    if (image.end > mem_size) {
         std::cout << "INSUFFICIENT MEMORY SPACE\n";
         std::cout << std::flush;
         exit(2);
     }
+    return image;
+}
 
-    init_mem(mem_size);
+// where the loaded program's instructions are, for the coverage report
+unsigned int code_start = 0;
+unsigned int code_end = 0;
+
+void setup_memory(unsigned int mem_size, std::vector<unsigned char> program) {
+    ProgramImage image = read_image(mem_size, std::move(program));
+    if (!init_mem(mem_size)) {
+        std::cout << "INSUFFICIENT MEMORY SPACE\n";
+        std::cout << std::flush;
+        exit(2);
+    }
 
     // copy program to memory. I would love to combine this step with
     // init_mem, but the spec says init_mem must initialze prog_mem
     // separately so I can't.
-    for (unsigned int i = 0; i < program.size(); i++) {
-        prog_mem[i] = program[i];
-    }
-
-    // load first 4 bytes into PC register
-    reg_file[PC] = *(unsigned int*)prog_mem;
+    load_image(image);
+    predecode(image.code_start, image.code_end);
+    code_start = image.code_start;
+    code_end = image.code_end;
 }
 
 void emulator_error(unsigned int instruction_addr) {
@@ -35,49 +85,254 @@ void cleanup() {
 }
 
 int emulator_loop() {
-    while (true) {
-        unsigned int current_addr = reg_file[PC];
+    unsigned int failed_addr;
+    bool ok = run_loop(failed_addr);
+    if (!ok) {
+        emulator_error(failed_addr);
+    }
 
-        if (!fetch()) {
-            emulator_error(current_addr);
-            return 1;
-        }
+    // Cores started with TRP #100 may still be running on globals that exit
+    // would destroy, so end without static destructors. Reports are
+    // registered with at_exit and still get written.
+    if (cores_started()) {
+        cleanup();
+        std::quick_exit(ok ? 0 : 1);
+    }
+    if (!ok) {
+        return 1;
+    }
+
+    cleanup();
+    exit(0);
+}
 
-        if (!decode()) {
-            emulator_error(current_addr);
-            return 1;
+// Splits the command line into positional arguments and `--name[=value]`
+// options. Returns false on an unknown option.
+bool parse_args(int argc, char* argv[], std::vector<std::string>& positional,
+                std::map<std::string, std::string>& options) {
+    static const std::vector<std::string> known = {"sweep", "sweep-out", "jobs",
+                                                   "sample-profile", "profile-out", "symbols",
+                                                   "flamegraph", "smp", "serve", "connect",
+                                                   "trace", "stats", "hugepages", "coverage",
+                                                   "result-cache", "result-cache-size", "hot-traces"};
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg.rfind("--", 0) != 0) {
+            positional.push_back(arg);
+            continue;
         }
 
-        if (!execute()) {
-            emulator_error(current_addr);
-            return 1;
+        auto equals = arg.find('=');
+        std::string name = arg.substr(2, equals == std::string::npos ? std::string::npos : equals - 2);
+        std::string value = equals == std::string::npos ? "" : arg.substr(equals + 1);
+        if (std::find(known.begin(), known.end(), name) == known.end()) {
+            std::cout << "Unknown option: " << arg << "\n";
+            return false;
         }
+        options[name] = value;
+    }
+    return true;
+}
 
-        if (flag == TERMINATE) {
-            cleanup();
-            exit(0);
+// where the sample profile is written when the emulator exits, empty for
+// stderr, and where the folded stacks go, empty for none
+bool profiling = false;
+std::string profile_out;
+std::string flamegraph_out;
+unsigned int sample_frequency = 1000;
+SymbolTable symbols;
+
+// registers a report to write when the emulator exits, by exit or quick_exit
+void at_exit(void (*report)()) {
+    std::atexit(report);
+    std::at_quick_exit(report);
+}
+
+void write_profile_at_exit() {
+    stop_sample_profile();
+    if (!flamegraph_out.empty()) {
+        std::ofstream folded(flamegraph_out);
+        write_folded_stacks(folded);
+    }
+    if (profile_out.empty()) {
+        write_sample_profile(std::cerr);
+        return;
+    }
+    std::ofstream out(profile_out);
+    write_sample_profile(out);
+}
+
+void write_stats_at_exit() {
+    write_instruction_counts(std::cerr);
+}
+
+std::string coverage_out;
+const SymbolTable* coverage_symbols = nullptr;
+
+void write_coverage_at_exit() {
+    std::ofstream out(coverage_out);
+    write_coverage(out, code_start, code_end, coverage_symbols);
+}
+
+// false (after saying so) if the sampling timer can't be started
+bool start_profiling() {
+    if (!flamegraph_out.empty()) {
+        start_profile_stacks(reg_file[PC]);
+    }
+    if (!start_sample_profile(sample_frequency)) {
+        std::cout << "Unable to start the sample profiler.\n" << std::flush;
+        return false;
+    }
+    at_exit(write_profile_at_exit);
+    return true;
+}
+
+// runs the loaded program once per input file in parallel and prints a summary
+int sweep(const std::map<std::string, std::string>& options) {
+    // verify the entry point once instead of failing in every run
+    if (reg_file[PC] > MEM_SIZE - 8) {
+        emulator_error(reg_file[PC]);
+        return 1;
+    }
+
+    std::vector<std::string> inputs;
+    if (!collect_sweep_inputs(options.at("sweep"), inputs)) {
+        std::cout << "Unable to read sweep inputs from " << options.at("sweep") << "\n";
+        return 3;
+    }
+
+    unsigned int jobs = std::thread::hardware_concurrency();
+    if (options.count("jobs") && !parse_unsigned_int(options.at("jobs"), jobs)) {
+        std::cout << "Invalid job count.\n";
+        return 3;
+    }
+
+    std::string out_dir = options.count("sweep-out") ? options.at("sweep-out") : "sweep_output";
+    auto results = run_sweep(inputs, out_dir, jobs, [&](const SweepResult& run) {
+        // interval timers aren't inherited, so each run profiles itself
+        if (profiling) {
+            std::string base = run.output.substr(0, run.output.size() - 4);
+            profile_out = base + ".profile";
+            flamegraph_out = flamegraph_out.empty() ? "" : base + ".folded";
+            if (!start_profiling()) {
+                return 3;
+            }
         }
+        if (!coverage_out.empty()) {
+            coverage_out = run.output.substr(0, run.output.size() - 4) + ".coverage";
+            at_exit(write_coverage_at_exit);
+        }
+        return emulator_loop();
+    });
+    print_sweep_summary(results);
+    return 0;
+}
+
+// keeps emu4380 resident and runs jobs sent over a Unix socket
+int serve(const std::map<std::string, std::string>& options, const std::vector<std::string>& args) {
+    // the optional argument is the most memory a job may ask for
+    unsigned int pool_size = 0b1 << 17;
+    if (args.size() >= 1 && !parse_unsigned_int(args[0], pool_size)) {
+        std::cout << "Invalid memory size. Max memory size is 4294967295.\n" << std::flush;
+        return 4;
     }
+
+    unsigned int workers = std::thread::hardware_concurrency();
+    if (options.count("jobs") && !parse_unsigned_int(options.at("jobs"), workers)) {
+        std::cout << "Invalid job count.\n";
+        return 3;
+    }
+
+    return run_server(options.at("serve"), pool_size, workers, [](const ServerJob& job) {
+        ProgramImage image = read_image(job.mem_size, job.image);
+        load_image(image);
+        predecode(image.code_start, image.code_end);
+        return emulator_loop();
+    });
+}
+
+// replays the result of an earlier run with the same binary, memory size and
+// stdin, or runs the program and caches its result
+int run_cached(const std::map<std::string, std::string>& options, unsigned int mem_size,
+               const std::vector<unsigned char>& program) {
+    std::string cache_dir = options.at("result-cache");
+    if (cache_dir.empty()) {
+        const char* home = std::getenv("HOME");
+        cache_dir = std::string(home ? home : ".") + "/.cache/emu4380";
+    }
+
+    unsigned int size_mib = 256;
+    if (options.count("result-cache-size") && !parse_unsigned_int(options.at("result-cache-size"), size_mib)) {
+        std::cout << "Invalid result cache size.\n";
+        return 3;
+    }
+
+    return run_with_result_cache(cache_dir, (unsigned long long)size_mib << 20, program, mem_size, [&]() {
+        setup_memory(mem_size, program);
+        return emulator_loop();
+    });
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
+    std::vector<std::string> args;
+    std::map<std::string, std::string> options;
+    if (!parse_args(argc, argv, args, options)) {
+        return 3;
+    }
+
+    if (options.count("smp") && (!parse_unsigned_int(options.at("smp"), max_cores) || max_cores == 0)) {
+        std::cout << "Invalid core count.\n";
+        return 3;
+    }
+
+    // huge pages are used for large memories unless asked for or turned off
+    if (options.count("hugepages")) {
+        auto& value = options.at("hugepages");
+        if (value.empty() || value == "on") {
+            huge_page_mode = HUGE_PAGES_ON;
+        }
+        else if (value == "off") {
+            huge_page_mode = HUGE_PAGES_OFF;
+        }
+        else {
+            std::cout << "Invalid huge page setting. Must be on or off.\n";
+            return 3;
+        }
+    }
+
+    // loops are only replayed from hot traces when asked for
+    if (options.count("hot-traces")) {
+        auto& value = options.at("hot-traces");
+        if (value.empty() || value == "on") {
+            hot_traces_enabled = true;
+        }
+        else if (value != "off") {
+            std::cout << "Invalid hot trace setting. Must be on or off.\n";
+            return 3;
+        }
+    }
+
+    if (options.count("serve")) {
+        return serve(options, args);
+    }
+
+    if (args.size() < 1) {
         std::cout << "A binary file argument is required\n";
         return 3;
     }
 
     // read file in as bytes
-    std::string in_path(argv[1]);
-    std::ifstream in_file(in_path, std::ios_base::binary);
-
-    auto begin = std::istreambuf_iterator<char>(in_file);
-    auto end = std::istreambuf_iterator<char>();
-    std::vector<unsigned char> program(begin, end);
+    std::vector<unsigned char> program;
+    if (!read_program(args[0], program)) {
+        std::cout << "INVALID BINARY: image stream ended early\n";
+        return 6;
+    }
 
     // read in second argument as memory size
     unsigned int mem_size = 0b1 << 17;
-    if (argc >= 3) {
-        std::string in_mem_size = argv[2];
+    if (args.size() >= 2) {
+        std::string in_mem_size = args[1];
 
         unsigned int potential_mem_size = 0;
         if (!parse_unsigned_int(in_mem_size, potential_mem_size)) {
@@ -87,7 +342,77 @@ int main(int argc, char* argv[]) {
         mem_size = potential_mem_size;
     }
 
+    if (options.count("connect")) {
+        return run_client(options.at("connect"), {mem_size, program});
+    }
+
+    // runs with other outputs than stdout, or more than one core, are always
+    // emulated
+    bool deterministic = max_cores == 1;
+    for (auto option : {"sweep", "sample-profile", "flamegraph", "trace", "stats", "coverage"}) {
+        deterministic = deterministic && !options.count(option);
+    }
+    // the cache reads all of stdin before running, which would hold back an
+    // interactive program's prompts until end of input
+    if (options.count("result-cache") && deterministic && !isatty(STDIN_FILENO)) {
+        return run_cached(options, mem_size, program);
+    }
+
     setup_memory(mem_size, program);
 
+    if (options.count("symbols")) {
+        if (!load_symbols(options.at("symbols"), symbols)) {
+            std::cout << "Unable to read symbol file " << options.at("symbols") << "\n";
+            return 3;
+        }
+        set_profile_symbols(&symbols);
+        coverage_symbols = &symbols;
+    }
+
+    // a flamegraph implies sampling at the default frequency
+    profiling = options.count("sample-profile") || options.count("flamegraph");
+    if (profiling) {
+        if (options.count("sample-profile") && !options.at("sample-profile").empty() &&
+            !parse_unsigned_int(options.at("sample-profile"), sample_frequency)) {
+            sample_frequency = 0;
+        }
+        if (sample_frequency == 0 || sample_frequency > 1000000) {
+            std::cout << "Invalid sample profile frequency. Must be 1 to 1000000 Hz.\n";
+            return 3;
+        }
+        profile_out = options.count("profile-out") ? options.at("profile-out") : "";
+        flamegraph_out = options.count("flamegraph") ? options.at("flamegraph") : "";
+    }
+
+    // options that cost time per instruction are compiled into the loop
+    // only when they are asked for
+    run_loop = select_run_loop(!flamegraph_out.empty(), options.count("trace"), options.count("stats"),
+                               options.count("coverage"));
+    if (options.count("stats")) {
+        at_exit(write_stats_at_exit);
+    }
+    if (options.count("coverage")) {
+        coverage_out = options.at("coverage");
+        if (coverage_out.empty()) {
+            std::cout << "A coverage file is required.\n";
+            return 3;
+        }
+        if (!start_coverage()) {
+            std::cout << "INSUFFICIENT MEMORY SPACE\n";
+            return 2;
+        }
+    }
+
+    if (options.count("sweep")) {
+        return sweep(options);
+    }
+
+    if (profiling && !start_profiling()) {
+        return 3;
+    }
+    if (!coverage_out.empty()) {
+        at_exit(write_coverage_at_exit);
+    }
+
     return emulator_loop();
 }
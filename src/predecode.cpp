@@ -0,0 +1,191 @@
+#include "../include/predecode.h"
+#include "../include/trace_cache.h"
+#include <cstring>
+#include <vector>
+
+static std::vector<Predecoded> table;
+static unsigned int table_start = 0;
+
+void divide_plan(std::int32_t d, Predecoded& entry) {
+  // Hacker's Delight figure 10-1: find the smallest shift p >= 32 for which
+  // magic = ceil(2^p / |d|) gives the exact quotient for every 32-bit n.
+  const std::uint32_t two31 = 0x80000000u;
+  std::uint32_t ad = d < 0 ? 0u - (std::uint32_t)d : (std::uint32_t)d;
+  std::uint32_t t = two31 + ((std::uint32_t)d >> 31);
+  std::uint32_t anc = t - 1 - t % ad;
+  int p = 31;
+  std::uint32_t q1 = two31 / anc;
+  std::uint32_t r1 = two31 - q1 * anc;
+  std::uint32_t q2 = two31 / ad;
+  std::uint32_t r2 = two31 - q2 * ad;
+  std::uint32_t delta;
+  do {
+    p++;
+    q1 = 2 * q1;
+    r1 = 2 * r1;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 = 2 * q2;
+    r2 = 2 * r2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  std::uint32_t magic = q2 + 1;
+  if (d < 0) {
+    magic = 0u - magic;
+  }
+
+  entry.plan = ArithPlan::MAGIC;
+  entry.magic = (std::int32_t)magic;
+  entry.shift = p - 32;
+  if (d > 0 && entry.magic < 0) {
+    entry.correction = 1;
+  }
+  else if (d < 0 && entry.magic > 0) {
+    entry.correction = -1;
+  }
+  else {
+    entry.correction = 0;
+  }
+}
+
+static bool power_of_two(std::uint32_t value, unsigned char& shift) {
+  if (value == 0 || (value & (value - 1)) != 0) {
+    return false;
+  }
+  shift = __builtin_ctz(value);
+  return true;
+}
+
+static void plan_arithmetic(Predecoded& entry) {
+  auto immed = entry.inst.immediate;
+
+  if (entry.inst.operation == MULI) {
+    if (immed == 1) {
+      entry.plan = ArithPlan::COPY;
+    }
+    else if (power_of_two(immed, entry.shift)) {
+      entry.plan = ArithPlan::SHIFT;
+    }
+  }
+  else if (entry.inst.operation == DIVI) {
+    auto divisor = (std::int32_t)immed;
+    std::uint32_t magnitude = divisor < 0 ? 0u - immed : immed;
+
+    if (divisor == 0) {
+      entry.plan = ArithPlan::DIV_ZERO;
+    }
+    else if (divisor == 1) {
+      entry.plan = ArithPlan::COPY;
+    }
+    else if (divisor == -1) {
+      entry.plan = ArithPlan::NEGATE;
+    }
+    else if (power_of_two(magnitude, entry.shift)) {
+      entry.plan = ArithPlan::SHIFT;
+      entry.negate = divisor < 0;
+    }
+    else {
+      divide_plan(divisor, entry);
+    }
+  }
+}
+
+void predecode(unsigned int code_start, unsigned int code_end) {
+  clear_predecode();
+  if (code_end > MEM_SIZE || code_start >= code_end || code_end - code_start < 8) {
+    return;
+  }
+
+  table_start = code_start;
+  table.resize((code_end - code_start) / 8);
+  for (size_t i = 0; i < table.size(); i++) {
+    auto& entry = table[i];
+    auto address = code_start + i * 8;
+
+    entry = Predecoded();
+    entry.inst = decode_instruction(prog_mem + address);
+    // invalid slots (data, or code that is never reached) keep operation 0
+    if (!decode(entry.inst)) {
+      entry.inst = Instruction();
+      continue;
+    }
+    std::memcpy(&entry.word, prog_mem + address, sizeof(entry.word));
+    plan_arithmetic(entry);
+
+    auto op = entry.inst.operation;
+    if (op == STR || op == LDR) {
+      entry.address_checked = entry.inst.immediate <= MEM_SIZE - 4;
+    }
+    else if (op == STB || op == LDB) {
+      entry.address_checked = entry.inst.immediate <= MEM_SIZE - 1;
+    }
+  }
+}
+
+void clear_predecode() {
+  // traces point into the table
+  clear_traces();
+  table.clear();
+  table_start = 0;
+}
+
+const Predecoded* find_predecoded(unsigned int address) {
+  if (address < table_start) {
+    return nullptr;
+  }
+  auto offset = address - table_start;
+  if (offset % 8 != 0 || offset / 8 >= table.size()) {
+    return nullptr;
+  }
+
+  const auto& entry = table[offset / 8];
+  if (entry.inst.operation == 0 ||
+      std::memcmp(prog_mem + address, &entry.word, sizeof(entry.word)) != 0) {
+    return nullptr;
+  }
+  return &entry;
+}
+
+bool execute_plan(const Predecoded& entry) {
+  auto r_dest = entry.inst.operand_1;
+  auto n = reg_file[entry.inst.operand_2];
+
+  switch (entry.plan) {
+    case ArithPlan::NONE:
+      return execute(entry.inst);
+    case ArithPlan::DIV_ZERO:
+      return false;
+    case ArithPlan::COPY:
+      reg_file[r_dest] = n;
+      return true;
+    case ArithPlan::NEGATE:
+      reg_file[r_dest] = 0u - n;
+      return true;
+    case ArithPlan::SHIFT:
+      if (entry.inst.operation == MULI) {
+        reg_file[r_dest] = n << entry.shift;
+      }
+      else {
+        // round toward zero: bias negative dividends by 2^shift - 1
+        std::uint32_t bias = (std::uint32_t)((std::int32_t)n >> 31) >> (32 - entry.shift);
+        std::uint32_t q = (std::uint32_t)((std::int32_t)(n + bias) >> entry.shift);
+        reg_file[r_dest] = entry.negate ? 0u - q : q;
+      }
+      return true;
+    case ArithPlan::MAGIC: {
+      auto q = (std::uint32_t)(((std::int64_t)entry.magic * (std::int32_t)n) >> 32);
+      q += entry.correction * n;
+      q = (std::uint32_t)((std::int32_t)q >> entry.shift);
+      reg_file[r_dest] = q + (q >> 31);
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,235 @@
+#include "../include/profiler.h"
+#include "../include/emu4380.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Open addressing table of (stack frame, PC) -> sample count. It is never
+// resized because the signal handler can't allocate; samples that can't find
+// a slot are counted as dropped. Keys are (frame + 1) << 32 | PC so that 0
+// marks an empty slot.
+static const unsigned int SAMPLE_SLOTS = 1 << 16;
+static const unsigned int MAX_PROBES = 64;
+static std::uint64_t sample_keys[SAMPLE_SLOTS];
+static std::uint64_t sample_counts[SAMPLE_SLOTS];
+static std::uint64_t samples_dropped = 0;
+static std::uint64_t samples_total = 0;
+static unsigned int sample_frequency = 0;
+static timer_t sample_timer;
+static bool timer_running = false;
+
+static const SymbolTable* profile_symbols = nullptr;
+
+// Stack frames form a tree rooted at the entry point. Only the emulator
+// thread changes it, the signal handler just reads current_frame.
+struct Frame {
+  unsigned int parent;
+  unsigned int region;
+  unsigned int depth;
+  std::map<unsigned int, unsigned int> children;
+};
+static const unsigned int MAX_STACK_DEPTH = 64;
+static std::vector<Frame> frames;
+static volatile unsigned int current_frame = 0;
+
+static void record_sample(int) {
+  std::uint64_t key = ((std::uint64_t)current_frame + 1) << 32 | reg_file[PC];
+  samples_total++;
+
+  unsigned int slot = (unsigned int)((key * 0x9E3779B97F4A7C15ull) >> 48) & (SAMPLE_SLOTS - 1);
+  for (unsigned int i = 0; i < MAX_PROBES; i++) {
+    if (sample_keys[slot] == key) {
+      sample_counts[slot]++;
+      return;
+    }
+    if (sample_keys[slot] == 0) {
+      sample_keys[slot] = key;
+      sample_counts[slot] = 1;
+      return;
+    }
+    slot = (slot + 1) & (SAMPLE_SLOTS - 1);
+  }
+  samples_dropped++;
+}
+
+bool start_sample_profile(unsigned int frequency) {
+  if (frequency == 0 || frequency > 1000000) {
+    return false;
+  }
+  sample_frequency = frequency;
+
+  struct sigaction action = {};
+  action.sa_handler = record_sample;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, nullptr) != 0) {
+    return false;
+  }
+
+  // A monotonic timer rather than ITIMER_PROF, which only fires on scheduler
+  // ticks and so caps the sample rate at the kernel's HZ.
+  struct sigevent event = {};
+  event.sigev_notify = SIGEV_SIGNAL;
+  event.sigev_signo = SIGPROF;
+  if (timer_create(CLOCK_MONOTONIC, &event, &sample_timer) != 0) {
+    return false;
+  }
+  timer_running = true;
+
+  // 1 Hz is a whole second, which tv_nsec can't hold
+  unsigned long long period = 1000000000ull / frequency;
+  struct itimerspec interval = {};
+  interval.it_interval.tv_sec = period / 1000000000ull;
+  interval.it_interval.tv_nsec = period % 1000000000ull;
+  interval.it_value = interval.it_interval;
+  return timer_settime(sample_timer, 0, &interval, nullptr) == 0;
+}
+
+void stop_sample_profile() {
+  if (timer_running) {
+    timer_delete(sample_timer);
+    timer_running = false;
+  }
+}
+
+void set_profile_symbols(const SymbolTable* symbols) {
+  profile_symbols = symbols;
+}
+
+// jumps are grouped by the label they land in when there are symbols
+static unsigned int region_of(unsigned int address) {
+  if (profile_symbols != nullptr) {
+    const Symbol* label = find_label(*profile_symbols, address);
+    if (label != nullptr) {
+      return label->address;
+    }
+  }
+  return address;
+}
+
+static void on_jump(unsigned int target) {
+  unsigned int region = region_of(target);
+
+  // jumping back into a frame on the stack pops to it
+  for (unsigned int frame = current_frame;; frame = frames[frame].parent) {
+    if (frames[frame].region == region) {
+      current_frame = frame;
+      return;
+    }
+    if (frame == 0) {
+      break;
+    }
+  }
+
+  unsigned int parent = current_frame;
+  if (frames[parent].depth >= MAX_STACK_DEPTH) {
+    return;
+  }
+
+  auto child = frames[parent].children.find(region);
+  if (child != frames[parent].children.end()) {
+    current_frame = child->second;
+    return;
+  }
+
+  unsigned int frame = frames.size();
+  frames.push_back({parent, region, frames[parent].depth + 1, {}});
+  frames[parent].children[region] = frame;
+  current_frame = frame;
+}
+
+void start_profile_stacks(unsigned int entry) {
+  frames.clear();
+  frames.push_back({0, region_of(entry), 0, {}});
+  current_frame = 0;
+  jump_hook = on_jump;
+}
+
+// The sampled PC has usually been advanced past the instruction being
+// executed, so samples are attributed to the instruction before it.
+static unsigned int sampled_address(std::uint64_t key) {
+  unsigned int pc = (unsigned int)key;
+  return pc >= 8 ? pc - 8 : pc;
+}
+
+static std::string address_name(unsigned int address, bool with_line) {
+  if (profile_symbols != nullptr) {
+    const Symbol* label = find_label(*profile_symbols, address);
+    if (label != nullptr) {
+      if (!with_line) {
+        return label->name;
+      }
+      return label->name + ":" + std::to_string(find_line(*profile_symbols, address));
+    }
+  }
+  return "@" + std::to_string(address);
+}
+
+void write_sample_profile(std::ostream& out) {
+  std::map<unsigned int, std::uint64_t> per_address;
+  for (unsigned int i = 0; i < SAMPLE_SLOTS; i++) {
+    if (sample_keys[i] != 0) {
+      per_address[sampled_address(sample_keys[i])] += sample_counts[i];
+    }
+  }
+
+  std::vector<std::pair<std::uint64_t, unsigned int>> hits;
+  for (auto& entry : per_address) {
+    hits.push_back({entry.second, entry.first});
+  }
+  std::stable_sort(hits.begin(), hits.end(), [](auto& a, auto& b) { return a.first > b.first; });
+
+  out << "# emu4380 sample profile: " << samples_total << " samples at " << sample_frequency
+      << " Hz, " << samples_dropped << " dropped\n";
+  out << "# samples  percent  address";
+  if (profile_symbols != nullptr) {
+    out << "  label:line";
+  }
+  out << "\n";
+
+  for (auto& hit : hits) {
+    double percent = 100.0 * hit.first / samples_total;
+    out << std::setw(9) << hit.first << "  "
+        << std::setw(6) << std::fixed << std::setprecision(2) << percent << "%  "
+        << hit.second;
+    if (profile_symbols != nullptr) {
+      out << "  " << address_name(hit.second, true);
+    }
+    out << "\n";
+  }
+  out << std::flush;
+}
+
+void write_folded_stacks(std::ostream& out) {
+  std::map<std::string, std::uint64_t> stacks;
+  for (unsigned int i = 0; i < SAMPLE_SLOTS; i++) {
+    if (sample_keys[i] == 0) {
+      continue;
+    }
+
+    std::string stack = address_name(sampled_address(sample_keys[i]), true);
+    unsigned int frame = (unsigned int)(sample_keys[i] >> 32) - 1;
+    if (frame < frames.size()) {
+      while (true) {
+        stack = address_name(frames[frame].region, false) + ";" + stack;
+        if (frame == 0) {
+          break;
+        }
+        frame = frames[frame].parent;
+      }
+    }
+    stacks[stack] += sample_counts[i];
+  }
+
+  for (auto& stack : stacks) {
+    out << stack.first << " " << stack.second << "\n";
+  }
+  out << std::flush;
+}
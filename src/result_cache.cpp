@@ -0,0 +1,213 @@
+#include "../include/result_cache.h"
+#include "../include/emu4380.h"
+#include "../include/loader.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static bool read_all(int fd, std::vector<unsigned char>& data) {
+  unsigned char buffer[1 << 16];
+  ssize_t count;
+  while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+    data.insert(data.end(), buffer, buffer + count);
+  }
+  return count == 0;
+}
+
+static bool write_all(int fd, const unsigned char* data, size_t size) {
+  while (size > 0) {
+    ssize_t count = write(fd, data, size);
+    if (count <= 0) {
+      return false;
+    }
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+// hash of this executable, read once
+static const std::vector<unsigned char>& emulator_image() {
+  static std::vector<unsigned char> image;
+  static bool loaded = false;
+  if (!loaded) {
+    std::ifstream exe("/proc/self/exe", std::ios_base::binary);
+    image.assign(std::istreambuf_iterator<char>(exe), std::istreambuf_iterator<char>());
+    loaded = true;
+  }
+  return image;
+}
+
+// two FNV-1a passes with different offset bases make a 128-bit key. Every
+// part is length prefixed so parts can't run into each other.
+std::string result_key(const std::vector<unsigned char>& image, unsigned int mem_size,
+                       const std::vector<unsigned char>& input) {
+  unsigned long long hashes[2] = {0xcbf29ce484222325ull, 0x6c62272e07bb0142ull};
+  unsigned char size[8];
+  for (auto& hash : hashes) {
+    for (auto part : {&emulator_image(), &image, &input}) {
+      store_word(size, (unsigned int)part->size());
+      store_word(size + 4, (unsigned int)((unsigned long long)part->size() >> 32));
+      hash = fnv1a_64(size, 8, hash);
+      hash = fnv1a_64(part->data(), part->size(), hash);
+    }
+    store_word(size, mem_size);
+    hash = fnv1a_64(size, 4, hash);
+  }
+
+  char key[33];
+  std::snprintf(key, sizeof(key), "%016llx%016llx", hashes[0], hashes[1]);
+  return key;
+}
+
+void evict_results(const std::string& cache_dir, unsigned long long size_limit, const std::string& keep) {
+  DIR* dir = opendir(cache_dir.c_str());
+  if (dir == nullptr) {
+    return;
+  }
+
+  // (last use, size, name) of every entry
+  struct Entry {
+    struct timespec used;
+    unsigned long long size;
+    std::string name;
+  };
+  std::vector<Entry> entries;
+  unsigned long long total = 0;
+  while (dirent* item = readdir(dir)) {
+    struct stat info;
+    std::string name = item->d_name;
+    if (name[0] == '.' || stat((cache_dir + "/" + name).c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+      continue;
+    }
+    entries.push_back({info.st_mtim, (unsigned long long)info.st_size, name});
+    total += info.st_size;
+  }
+  closedir(dir);
+
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+    return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+  });
+  for (auto& entry : entries) {
+    if (total <= size_limit) {
+      break;
+    }
+    if (entry.name != keep && unlink((cache_dir + "/" + entry.name).c_str()) == 0) {
+      total -= entry.size;
+    }
+  }
+}
+
+static bool replay(const std::string& path, int& exit_code) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  std::vector<unsigned char> entry;
+  bool read_ok = read_all(fd, entry);
+  close(fd);
+  if (!read_ok || entry.size() < 4) {
+    return false;
+  }
+
+  // mark it as recently used
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+  exit_code = (int)load_word(entry.data());
+  write_all(STDOUT_FILENO, entry.data() + 4, entry.size() - 4);
+  return true;
+}
+
+// like mkdir -p
+static void make_directories(const std::string& path) {
+  for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+    mkdir(path.substr(0, slash).c_str(), 0755);
+  }
+  mkdir(path.c_str(), 0755);
+}
+
+static void store(const std::string& cache_dir, const std::string& key, int exit_code,
+                  const std::vector<unsigned char>& output) {
+  make_directories(cache_dir);
+
+  // written to a temporary name and renamed, so readers never see half an entry
+  std::string temp_path = cache_dir + "/." + key + "." + std::to_string(getpid());
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  unsigned char code[4];
+  store_word(code, (unsigned int)exit_code);
+  bool written = write_all(fd, code, 4) && write_all(fd, output.data(), output.size());
+  close(fd);
+  if (!written || rename(temp_path.c_str(), (cache_dir + "/" + key).c_str()) != 0) {
+    unlink(temp_path.c_str());
+  }
+}
+
+int run_with_result_cache(const std::string& cache_dir, unsigned long long size_limit,
+                          const std::vector<unsigned char>& image, unsigned int mem_size,
+                          const std::function<int()>& run) {
+  std::vector<unsigned char> input;
+  read_all(STDIN_FILENO, input);
+
+  std::string key = result_key(image, mem_size, input);
+  int exit_code;
+  if (replay(cache_dir + "/" + key, exit_code)) {
+    return exit_code;
+  }
+
+  // the run reads the input back from an in-memory file
+  int input_fd = memfd_create("emu4380-stdin", 0);
+  int output_pipe[2];
+  if (input_fd < 0 || pipe(output_pipe) != 0) {
+    std::cout << "Unable to run with the result cache.\n";
+    return 3;
+  }
+  write_all(input_fd, input.data(), input.size());
+  lseek(input_fd, 0, SEEK_SET);
+
+  std::cout << std::flush;
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(output_pipe[0]);
+    dup2(input_fd, STDIN_FILENO);
+    dup2(output_pipe[1], STDOUT_FILENO);
+    close(input_fd);
+    close(output_pipe[1]);
+
+    int code = run();
+    std::cout << std::flush;
+    exit(code);
+  }
+  close(input_fd);
+  close(output_pipe[1]);
+
+  // pass the output on as it is produced
+  std::vector<unsigned char> output;
+  unsigned char buffer[1 << 16];
+  ssize_t count;
+  while ((count = read(output_pipe[0], buffer, sizeof(buffer))) > 0) {
+    write_all(STDOUT_FILENO, buffer, count);
+    output.insert(output.end(), buffer, buffer + count);
+  }
+  close(output_pipe[0]);
+
+  int status = 0;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1;
+  }
+
+  exit_code = WEXITSTATUS(status);
+  store(cache_dir, key, exit_code, output);
+  evict_results(cache_dir, size_limit, key);
+  return exit_code;
+}
@@ -0,0 +1,304 @@
+#include "../include/server.h"
+#include "../include/emu4380.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// jobs can't send more than this much binary or input
+static const unsigned int max_request_bytes = 1u << 30;
+
+static bool read_exact(int fd, void* data, size_t size) {
+  auto bytes = (unsigned char*)data;
+  while (size > 0) {
+    ssize_t count = read(fd, bytes, size);
+    if (count <= 0) {
+      return false;
+    }
+    bytes += count;
+    size -= count;
+  }
+  return true;
+}
+
+static bool write_exact(int fd, const void* data, size_t size) {
+  auto bytes = (const unsigned char*)data;
+  while (size > 0) {
+    ssize_t count = write(fd, bytes, size);
+    if (count <= 0) {
+      return false;
+    }
+    bytes += count;
+    size -= count;
+  }
+  return true;
+}
+
+static bool read_u32(int fd, unsigned int& value) {
+  unsigned char bytes[4];
+  if (!read_exact(fd, bytes, 4)) {
+    return false;
+  }
+  value = load_word(bytes);
+  return true;
+}
+
+static bool read_blob(int fd, std::vector<unsigned char>& blob) {
+  unsigned int length;
+  if (!read_u32(fd, length) || length > max_request_bytes) {
+    return false;
+  }
+  blob.resize(length);
+  return read_exact(fd, blob.data(), length);
+}
+
+static void append_u32(std::vector<unsigned char>& out, unsigned int value) {
+  unsigned char bytes[4];
+  store_word(bytes, value);
+  out.insert(out.end(), bytes, bytes + 4);
+}
+
+static void append_u64(std::vector<unsigned char>& out, unsigned long long value) {
+  append_u32(out, (unsigned int)value);
+  append_u32(out, (unsigned int)(value >> 32));
+}
+
+static bool send_frame(int fd, ServerFrame type, const unsigned char* payload, unsigned int length) {
+  std::vector<unsigned char> header = {(unsigned char)type};
+  append_u32(header, length);
+  return write_exact(fd, header.data(), header.size()) && write_exact(fd, payload, length);
+}
+
+static int connect_socket(const std::string& path, sockaddr_un& address) {
+  if (path.size() >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::strcpy(address.sun_path, path.c_str());
+  return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+// reads a request, filling in the image from the path for path jobs
+static bool read_request(int conn, ServerJob& job, std::vector<unsigned char>& input) {
+  unsigned char kind;
+  if (!read_exact(conn, &kind, 1) || kind > 1 || !read_u32(conn, job.mem_size) ||
+      !read_blob(conn, job.image) || !read_blob(conn, input)) {
+    return false;
+  }
+
+  if (kind == 0) {
+    // an unreadable path leaves the image empty, which fails like a bad binary
+    std::string path(job.image.begin(), job.image.end());
+    std::ifstream in_file(path, std::ios_base::binary);
+    job.image.assign(std::istreambuf_iterator<char>(in_file), std::istreambuf_iterator<char>());
+  }
+  return true;
+}
+
+// runs in the job's process, never returns
+static void run_job(const ServerJob& job, int input_fd, int output_fd, unsigned int pool_size,
+                    const std::function<int(const ServerJob&)>& run) {
+  dup2(input_fd, STDIN_FILENO);
+  dup2(output_fd, STDOUT_FILENO);
+  close(input_fd);
+  close(output_fd);
+
+  if (job.mem_size > pool_size) {
+    std::cout << "Invalid memory size. Max memory size is " << pool_size << ".\n" << std::flush;
+    exit(4);
+  }
+
+  // prog_mem is already the worker's pool
+  MEM_SIZE = job.mem_size;
+
+  int code = run(job);
+  std::cout << std::flush;
+  exit(code);
+}
+
+static void serve_connection(int conn, unsigned int pool_size,
+                             const std::function<int(const ServerJob&)>& run) {
+  using Clock = std::chrono::steady_clock;
+
+  ServerJob job;
+  std::vector<unsigned char> input;
+  if (!read_request(conn, job, input)) {
+    return;
+  }
+
+  // stdin comes from an in-memory file so the job can read it at its own pace
+  int input_fd = memfd_create("emu4380-stdin", 0);
+  int output_pipe[2];
+  if (input_fd < 0) {
+    return;
+  }
+  if (pipe(output_pipe) != 0) {
+    close(input_fd);
+    return;
+  }
+  write_exact(input_fd, input.data(), input.size());
+  lseek(input_fd, 0, SEEK_SET);
+
+  auto start = Clock::now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(conn);
+    close(output_pipe[0]);
+    run_job(job, input_fd, output_pipe[1], pool_size, run);
+  }
+  close(input_fd);
+  close(output_pipe[1]);
+
+  // stream the output as it is produced. If the client went away, keep
+  // draining so the job doesn't block on a full pipe.
+  bool connected = true;
+  unsigned char buffer[1 << 16];
+  ssize_t count;
+  while ((count = read(output_pipe[0], buffer, sizeof(buffer))) > 0) {
+    connected = connected && send_frame(conn, OUTPUT_FRAME, buffer, count);
+  }
+  close(output_pipe[0]);
+
+  int status = 0;
+  rusage usage;
+  std::memset(&usage, 0, sizeof(usage));
+  int exit_code = 128;
+  if (pid > 0 && wait4(pid, &status, 0, &usage) == pid) {
+    // report death by signal like a shell would
+    exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  }
+  auto micros = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+
+  std::vector<unsigned char> result;
+  append_u32(result, (unsigned int)exit_code);
+  append_u64(result, micros);
+  append_u64(result, usage.ru_maxrss);
+  if (connected) {
+    send_frame(conn, EXIT_FRAME, result.data(), result.size());
+  }
+
+  // the job wrote straight into the shared pool and marked what it touched
+  reset_mem();
+}
+
+static void run_worker(int listen_fd, unsigned int pool_size,
+                       const std::function<int(const ServerJob&)>& run) {
+  // don't outlive the server, and survive clients that hang up early
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Shared so that jobs, which are forks of this worker, write to the same
+  // pages instead of copy-on-write copies, and their dirty pages are known.
+  if (!init_shared_mem(pool_size)) {
+    std::cerr << "Unable to allocate " << pool_size << " bytes of guest memory\n";
+    _exit(2);
+  }
+
+  while (true) {
+    int conn = accept(listen_fd, nullptr, nullptr);
+    if (conn < 0) {
+      continue;
+    }
+    serve_connection(conn, pool_size, run);
+    close(conn);
+  }
+}
+
+int run_server(const std::string& socket_path, unsigned int pool_size, unsigned int workers,
+               const std::function<int(const ServerJob&)>& run) {
+  sockaddr_un address;
+  int listen_fd = connect_socket(socket_path, address);
+  if (listen_fd < 0) {
+    std::cout << "Unable to create socket " << socket_path << "\n";
+    return 3;
+  }
+
+  // replace a socket left behind by an earlier server
+  unlink(socket_path.c_str());
+  if (bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, 64) != 0) {
+    std::cout << "Unable to listen on " << socket_path << "\n";
+    return 3;
+  }
+
+  // nothing buffered may be duplicated into the workers
+  std::cout << std::flush;
+
+  // start the workers and replace any that die
+  workers = std::max(workers, 1u);
+  unsigned int running = 0;
+  while (true) {
+    while (running < workers) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        run_worker(listen_fd, pool_size, run);
+      }
+      if (pid > 0) {
+        running++;
+      }
+      else {
+        sleep(1);
+      }
+    }
+
+    if (wait(nullptr) > 0) {
+      running--;
+    }
+  }
+}
+
+int run_client(const std::string& socket_path, const ServerJob& job) {
+  // the whole of stdin is sent up front
+  std::vector<unsigned char> input(std::istreambuf_iterator<char>(std::cin), {});
+
+  signal(SIGPIPE, SIG_IGN);
+  sockaddr_un address;
+  int fd = connect_socket(socket_path, address);
+  if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+    std::cout << "Unable to connect to " << socket_path << "\n";
+    return 3;
+  }
+
+  std::vector<unsigned char> request = {1};
+  append_u32(request, job.mem_size);
+  append_u32(request, job.image.size());
+  request.insert(request.end(), job.image.begin(), job.image.end());
+  append_u32(request, input.size());
+  request.insert(request.end(), input.begin(), input.end());
+  if (!write_exact(fd, request.data(), request.size())) {
+    std::cout << "Lost connection to " << socket_path << "\n";
+    return 3;
+  }
+
+  std::vector<unsigned char> payload;
+  while (true) {
+    unsigned char type;
+    if (!read_exact(fd, &type, 1) || !read_blob(fd, payload)) {
+      break;
+    }
+
+    if (type == OUTPUT_FRAME) {
+      std::cout.write((const char*)payload.data(), payload.size());
+    }
+    else if (type == EXIT_FRAME && payload.size() >= 4) {
+      close(fd);
+      std::cout << std::flush;
+      return (int)load_word(payload.data());
+    }
+  }
+
+  close(fd);
+  std::cout << std::flush << "Lost connection to " << socket_path << "\n";
+  return 3;
+}
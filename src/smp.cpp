@@ -0,0 +1,85 @@
+#include "../include/smp.h"
+#include "../include/emu4380.h"
+
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+unsigned int max_cores = 1;
+
+struct Core {
+  std::mutex lock;
+  std::condition_variable finished;
+  bool done = false;
+  bool joined = false;
+};
+
+// Cores are never freed and their threads are detached, so TRP #0 on core 0
+// doesn't wait for them. Once one has started the process has to end with
+// quick_exit or _exit: exit would run static destructors (the predecode
+// table, this vector, ...) while they may still be using them.
+static std::mutex cores_lock;
+static std::vector<Core*> cores;
+static unsigned int running_cores = 1;
+
+static void run_core(Core* core, unsigned int entry, unsigned int argument) {
+  std::memset(reg_file, 0, sizeof(reg_file));
+  reg_file[PC] = entry;
+  reg_file[R3] = argument;
+
+  unsigned int failed_addr;
+  if (!run_loop(failed_addr)) {
+    std::cout << "INVALID INSTRUCTION AT: " << failed_addr << "\n" << std::flush;
+    _exit(1);
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(cores_lock);
+    running_cores--;
+  }
+  {
+    std::lock_guard<std::mutex> guard(core->lock);
+    core->done = true;
+  }
+  core->finished.notify_all();
+}
+
+bool spawn_core(unsigned int entry, unsigned int argument, unsigned int& core_id) {
+  std::lock_guard<std::mutex> guard(cores_lock);
+  if (running_cores >= max_cores) {
+    return false;
+  }
+
+  Core* core = new Core();
+  cores.push_back(core);
+  core_id = cores.size();
+  running_cores++;
+
+  std::thread(run_core, core, entry, argument).detach();
+  return true;
+}
+
+bool cores_started() {
+  std::lock_guard<std::mutex> guard(cores_lock);
+  return !cores.empty();
+}
+
+bool join_core(unsigned int core_id) {
+  Core* core;
+  {
+    std::lock_guard<std::mutex> guard(cores_lock);
+    if (core_id == 0 || core_id > cores.size() || cores[core_id - 1]->joined) {
+      return false;
+    }
+    core = cores[core_id - 1];
+    core->joined = true;
+  }
+
+  std::unique_lock<std::mutex> wait(core->lock);
+  core->finished.wait(wait, [core] { return core->done; });
+  return true;
+}
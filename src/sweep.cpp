@@ -0,0 +1,176 @@
+#include "../include/sweep.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static bool is_directory(const std::string& path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+static bool is_regular_file(const std::string& path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+}
+
+static std::string base_name(const std::string& path) {
+  auto slash = path.find_last_of('/');
+  if (slash == std::string::npos) {
+    return path;
+  }
+  return path.substr(slash + 1);
+}
+
+bool collect_sweep_inputs(const std::string& source, std::vector<std::string>& inputs) {
+  if (is_directory(source)) {
+    DIR* dir = opendir(source.c_str());
+    if (dir == nullptr) {
+      return false;
+    }
+
+    while (dirent* entry = readdir(dir)) {
+      std::string path = source + "/" + entry->d_name;
+      if (is_regular_file(path)) {
+        inputs.push_back(path);
+      }
+    }
+    closedir(dir);
+
+    std::sort(inputs.begin(), inputs.end());
+    return true;
+  }
+
+  std::ifstream list(source);
+  if (!list) {
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(list, line)) {
+    if (!line.empty()) {
+      inputs.push_back(line);
+    }
+  }
+  return true;
+}
+
+// `<input name>` for every input, with `.2`, `.3`, ... added to names already
+// taken, so inputs from different directories don't share an output file
+static std::vector<std::string> output_names(const std::vector<std::string>& inputs) {
+  std::vector<std::string> names;
+  std::set<std::string> taken;
+  for (auto& input : inputs) {
+    std::string name = base_name(input);
+    for (unsigned int n = 2; taken.count(name); n++) {
+      name = base_name(input) + "." + std::to_string(n);
+    }
+    taken.insert(name);
+    names.push_back(name);
+  }
+  return names;
+}
+
+// runs in the forked child, never returns
+static void run_child(const SweepResult& result, const std::function<int(const SweepResult&)>& run) {
+  int in_fd = open(result.input.c_str(), O_RDONLY);
+  int out_fd = open(result.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (in_fd < 0 || out_fd < 0) {
+    _exit(127);
+  }
+
+  dup2(in_fd, STDIN_FILENO);
+  dup2(out_fd, STDOUT_FILENO);
+  close(in_fd);
+  close(out_fd);
+
+  int code = run(result);
+  std::cout << std::flush;
+  exit(code);
+}
+
+std::vector<SweepResult> run_sweep(const std::vector<std::string>& inputs,
+                                   const std::string& out_dir, unsigned int jobs,
+                                   const std::function<int(const SweepResult&)>& run) {
+  using Clock = std::chrono::steady_clock;
+
+  std::vector<SweepResult> results(inputs.size());
+  auto names = output_names(inputs);
+  std::map<pid_t, std::pair<size_t, Clock::time_point>> running;
+  mkdir(out_dir.c_str(), 0755);
+
+  // nothing buffered may be duplicated into the children
+  std::cout << std::flush;
+
+  size_t next = 0;
+  while (next < inputs.size() || !running.empty()) {
+    // keep up to `jobs` runs in flight
+    while (next < inputs.size() && running.size() < std::max(jobs, 1u)) {
+      results[next].input = inputs[next];
+      results[next].output = out_dir + "/" + names[next] + ".out";
+
+      pid_t pid = fork();
+      if (pid == 0) {
+        run_child(results[next], run);
+      }
+      if (pid < 0) {
+        results[next].exit_code = -1;
+        results[next].seconds = 0;
+      }
+      else {
+        running[pid] = {next, Clock::now()};
+      }
+      next++;
+    }
+
+    if (running.empty()) {
+      continue;
+    }
+
+    int status = 0;
+    pid_t pid = waitpid(-1, &status, 0);
+    auto found = running.find(pid);
+    if (found == running.end()) {
+      continue;
+    }
+
+    SweepResult& result = results[found->second.first];
+    std::chrono::duration<double> elapsed = Clock::now() - found->second.second;
+    result.seconds = elapsed.count();
+    // report death by signal like a shell would
+    result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    running.erase(found);
+  }
+
+  return results;
+}
+
+void print_sweep_summary(const std::vector<SweepResult>& results) {
+  size_t width = 5;
+  for (auto& result : results) {
+    width = std::max(width, result.input.size());
+  }
+
+  unsigned int failed = 0;
+  std::cout << std::left << std::setw(width) << "INPUT" << "  EXIT  SECONDS   OUTPUT\n";
+  for (auto& result : results) {
+    std::cout << std::left << std::setw(width) << result.input << "  "
+              << std::setw(4) << result.exit_code << "  "
+              << std::setw(8) << std::fixed << std::setprecision(4) << result.seconds << "  "
+              << result.output << "\n";
+    if (result.exit_code != 0) {
+      failed++;
+    }
+  }
+  std::cout << results.size() << " runs, " << failed << " with a non-zero exit code\n" << std::flush;
+}
@@ -0,0 +1,63 @@
+#include "../include/symbols.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+bool load_symbols(const std::string& path, SymbolTable& table) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+
+    std::istringstream fields(line);
+    std::string kind;
+    fields >> kind;
+    if (kind == "label") {
+      Symbol symbol;
+      if (!(fields >> symbol.address >> symbol.line >> symbol.name)) {
+        return false;
+      }
+      table.labels.push_back(symbol);
+    }
+    else if (kind == "line") {
+      unsigned int address, source_line;
+      if (!(fields >> address >> source_line)) {
+        return false;
+      }
+      table.lines.push_back({address, source_line});
+    }
+    else {
+      return false;
+    }
+  }
+
+  std::stable_sort(table.labels.begin(), table.labels.end(),
+                   [](const Symbol& a, const Symbol& b) { return a.address < b.address; });
+  std::sort(table.lines.begin(), table.lines.end());
+  return true;
+}
+
+const Symbol* find_label(const SymbolTable& table, unsigned int address) {
+  auto after = std::upper_bound(table.labels.begin(), table.labels.end(), address,
+                                [](unsigned int addr, const Symbol& s) { return addr < s.address; });
+  if (after == table.labels.begin()) {
+    return nullptr;
+  }
+  return &*(after - 1);
+}
+
+unsigned int find_line(const SymbolTable& table, unsigned int address) {
+  auto after = std::upper_bound(table.lines.begin(), table.lines.end(),
+                                std::make_pair(address, ~0u));
+  if (after == table.lines.begin()) {
+    return 0;
+  }
+  return (after - 1)->second;
+}
@@ -0,0 +1,103 @@
+#include "../include/trace_cache.h"
+#include <unordered_map>
+
+bool hot_traces_enabled = false;
+
+// what is known about a jump target
+struct TraceHead {
+  unsigned int jumps = 0;
+  bool rejected = false;  // was recorded, but didn't loop
+  HotTrace trace;         // no steps until recorded
+};
+
+static std::unordered_map<unsigned int, TraceHead> heads;
+static HotTrace recording;
+
+// whether the step after this instruction depends on registers. JMP, MOVI
+// and LDA always go to their immediate, stores only read PC.
+static bool guarded(const Instruction& inst) {
+  auto op = inst.operation;
+  return inst.operand_1 == PC && op != JMP && op != MOVI && op != LDA && op != STR && op != STB;
+}
+
+// finds the instructions of the trace each store writes to
+static void find_rewrites(HotTrace& trace) {
+  for (auto& step : trace.steps) {
+    auto op = step.entry->inst.operation;
+    if (op != STR && op != STB && op != CAS && op != FAA) {
+      continue;
+    }
+    unsigned long long start = step.entry->inst.immediate;
+    unsigned long long end = start + (op == STB ? 1 : 4);
+    for (auto& other : trace.steps) {
+      bool found = false;
+      for (unsigned int i = 0; i < step.rewrite_count; i++) {
+        found = found || step.rewrites[i] == other.address;
+      }
+      // a store covers at most two instruction slots
+      if (!found && start < other.address + 8ull && other.address < end) {
+        step.rewrites[step.rewrite_count++] = other.address;
+      }
+    }
+  }
+}
+
+static void finish_trace(bool loops) {
+  auto& head = heads[recording.head];
+  if (!loops) {
+    head.rejected = true;
+  }
+  else {
+    find_rewrites(recording);
+    head.trace = std::move(recording);
+  }
+  recording = HotTrace();
+}
+
+const HotTrace* jumped_to(unsigned int address, bool& record) {
+  record = false;
+  auto& head = heads[address];
+  if (!head.trace.steps.empty()) {
+    for (auto& step : head.trace.steps) {
+      if (find_predecoded(step.address) != step.entry) {
+        // the code changed, so it has to get hot again
+        head = TraceHead();
+        return nullptr;
+      }
+    }
+    return &head.trace;
+  }
+
+  if (!head.rejected && ++head.jumps == HOT_TRACE_THRESHOLD) {
+    record = true;
+  }
+  return nullptr;
+}
+
+void begin_trace(unsigned int head) {
+  recording = HotTrace();
+  recording.head = head;
+}
+
+bool record_step(unsigned int address) {
+  if (!recording.steps.empty()) {
+    recording.steps.back().next = address;
+    if (address == recording.head) {
+      finish_trace(true);
+      return false;
+    }
+  }
+
+  auto entry = find_predecoded(address);
+  if (entry == nullptr || entry->inst.operation == TRP || recording.steps.size() == HOT_TRACE_MAX_STEPS) {
+    finish_trace(false);
+    return false;
+  }
+  recording.steps.push_back({entry, address, address + 8, guarded(entry->inst), 0, {0, 0}});
+  return true;
+}
+
+void clear_traces() {
+  heads.clear();
+  recording = HotTrace();
+}
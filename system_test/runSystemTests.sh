@@ -173,3 +173,193 @@ if [ $exit_code -eq 1 ] && [ "$program_output" = "INVALID INSTRUCTION AT: 8" ];
 else 
   echo -e "${RED}RESULT: failed${NONE}"
 fi
+
+# Test parameter sweep runs the program once per input file
+mkdir -p sweep_inputs
+echo "12" > sweep_inputs/a
+echo "-7" > sweep_inputs/b
+echo "nope" > sweep_inputs/c
+program_output="$(../build/emu4380 --sweep=sweep_inputs --sweep-out=sweep_output ./binary/trp2_reads_int)"
+exit_code=$?
+echo -e "${GREEN}TEST: parameter sweep captures output and exit code per input"
+if [ $exit_code -eq 0 ] && [ "$(cat sweep_output/a.out)" = "12" ] && [ "$(cat sweep_output/b.out)" = "-7" ] \
+  && [ "$(echo "$program_output" | tail -n 1)" = "3 runs, 1 with a non-zero exit code" ]; then
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+rm -rf sweep_inputs sweep_output
+
+# Test sweep inputs with the same name get separate output files
+mkdir -p sweep_inputs/x sweep_inputs/y
+echo "5" > sweep_inputs/x/in
+echo "6" > sweep_inputs/y/in
+printf 'sweep_inputs/x/in\nsweep_inputs/y/in\n' > sweep_list
+program_output="$(../build/emu4380 --sweep=sweep_list --sweep-out=sweep_output ./binary/trp2_reads_int)"
+exit_code=$?
+echo -e "${GREEN}TEST: parameter sweep keeps outputs of inputs with the same name apart"
+if [ $exit_code -eq 0 ] && [ "$(cat sweep_output/in.out)" = "5" ] && [ "$(cat sweep_output/in.2.out)" = "6" ]; then
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+rm -rf sweep_inputs sweep_output sweep_list
+
+# Test trp105 prints a length prefixed string
+program_output="$(../build/emu4380 ./binary/trp105_writes_string | od -c | head -1)"
+echo -e "${GREEN}TEST: trp105 prints a length prefixed string"
+if [ "$program_output" = "0000000   H   e   l   l   o  \\n" ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test trp106 allocates from the heap after the image and moves HP
+program_output="$(../build/emu4380 ./binary/trp106_allocates)"
+exit_code=$?
+echo -e "${GREEN}TEST: trp106 allocates a block after the image"
+if [ $exit_code -eq 0 ] && [ "$program_output" = "$(printf '72\n104')" ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test TRP #0 on core 0 ends the program while another core is still running
+program_output="$(../build/emu4380 --smp=2 --stats ./binary/smp_exits_with_running_core 2>stats_test.txt)"
+exit_code=$?
+stats="$(head -1 stats_test.txt | cut -f1)"
+rm -f stats_test.txt
+echo -e "${GREEN}TEST: --smp program exits and writes reports while a core is running"
+if [ $exit_code -eq 0 ] && [ "$program_output" = "H" ] && [ "$stats" = "instructions" ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test server mode runs jobs sent by the client
+../build/emu4380 --serve=./emu4380_test.sock --jobs=2 &
+server_pid=$!
+for attempt in 1 2 3 4 5 6 7 8 9 10; do
+  [ -S ./emu4380_test.sock ] && break
+  sleep 0.1
+done
+program_output="$(../build/emu4380 --connect=./emu4380_test.sock ./binary/trp2_reads_int <<< "-432890")"
+exit_code=$?
+bad_input_output="$(../build/emu4380 --connect=./emu4380_test.sock ./binary/trp2_reads_int <<< "abc")"
+bad_input_code=$?
+kill $server_pid
+wait $server_pid 2>/dev/null
+rm -f ./emu4380_test.sock
+echo -e "${GREEN}TEST: server mode runs jobs and returns their output and exit code"
+if [ $exit_code -eq 0 ] && [ "$program_output" = "-432890" ] && [ $bad_input_code -eq 5 ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test --stats counts executed instructions without changing the output
+program_output="$(../build/emu4380 --stats ./binary/trp3_writes_char 2>&1 >/dev/null | head -1)"
+exit_code=$?
+echo -e "${GREEN}TEST: --stats reports executed instructions"
+if [ $exit_code -eq 0 ] && [ "$program_output" = "$(printf 'instructions\t3')" ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test --coverage writes which instructions ran
+program_output="$(../build/emu4380 --coverage=./coverage_test.txt ./binary/trp3_writes_char)"
+exit_code=$?
+coverage="$(head -1 ./coverage_test.txt)"
+rm -f ./coverage_test.txt
+echo -e "${GREEN}TEST: --coverage reports executed instruction slots"
+if [ $exit_code -eq 0 ] && [ "$program_output" = "H" ] && [ "$coverage" = "covered 3 3" ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test --result-cache replays the output and exit code of an earlier run
+rm -rf ./result_cache_test
+first_output="$(../build/emu4380 --result-cache=./result_cache_test ./binary/trp2_reads_int <<< "abc")"
+first_code=$?
+# change the cached output, so a replay is told apart from a run
+entry="$(ls ./result_cache_test)"
+printf '\005\000\000\000replayed' > "./result_cache_test/$entry"
+second_output="$(../build/emu4380 --result-cache=./result_cache_test ./binary/trp2_reads_int <<< "abc")"
+second_code=$?
+rm -rf ./result_cache_test
+echo -e "${GREEN}TEST: --result-cache replays cached output and exit code"
+if [ $first_code -eq 5 ] && [ "$first_output" = '"abc" is either not within range or not an integer.' ] && [ $second_code -eq 5 ] && [ "$second_output" = "replayed" ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test a framed image on stdin, followed by the program's input
+program_output="$( (printf '\040\000\000\000'; cat ./binary/trp2_reads_int; echo "-432890") | ../build/emu4380 -)"
+exit_code=$?
+truncated_output="$(printf '\100\000\000\000' | ../build/emu4380 -)"
+truncated_code=$?
+echo -e "${GREEN}TEST: a framed image is read from stdin and the rest is the program's input"
+if [ $exit_code -eq 0 ] && [ "$program_output" = "-432890" ] && [ $truncated_code -eq 6 ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test --hugepages runs the program the same and rejects unknown settings
+program_output="$(../build/emu4380 --hugepages ./binary/trp3_writes_char 4194304)"
+exit_code=$?
+../build/emu4380 --hugepages=maybe ./binary/trp3_writes_char > /dev/null
+bad_setting_code=$?
+echo -e "${GREEN}TEST: --hugepages runs programs and rejects unknown settings"
+if [ $exit_code -eq 0 ] && [ "$program_output" = "H" ] && [ $bad_setting_code -eq 3 ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test version 2 binary with separate data, bss and code segments
+program_output="$(../build/emu4380 ./binary/v2_sections)"
+exit_code=$?
+echo -e "${GREEN}TEST: version 2 binary loads data and code segments"
+if [ $exit_code -eq 0 ] && [ "$program_output" = "H" ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test version 2 binary with a corrupted segment
+program_output="$(../build/emu4380 ./binary/v2_bad_hash)"
+exit_code=$?
+echo -e "${GREEN}TEST: version 2 binary with a bad content hash is rejected"
+if [ $exit_code -eq 6 ] && [ "$program_output" = "INVALID BINARY: content hash mismatch" ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test emu4380-dis lists the blocks of a binary and rejects bad ones
+program_output="$(../build/emu4380-dis ./binary/trp3_writes_char | sed -n 4,6p)"
+exit_code=$?
+../build/emu4380-dis ./binary/v2_bad_hash > /dev/null
+bad_binary_code=$?
+echo -e "${GREEN}TEST: emu4380-dis disassembles a binary into blocks"
+if [ $exit_code -eq 0 ] && [ "$program_output" = "$(printf '  8\tMOVI R3, #72\n  16\tTRP #3\n  24\tTRP #0')" ] && [ $bad_binary_code -eq 6 ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
+
+# Test --hot-traces runs the program the same and unknown settings are rejected
+program_output="$(../build/emu4380 --hot-traces ./binary/trp3_writes_char)"
+exit_code=$?
+../build/emu4380 --hot-traces=maybe ./binary/trp3_writes_char > /dev/null
+bad_setting_code=$?
+echo -e "${GREEN}TEST: --hot-traces runs programs and rejects unknown settings"
+if [ $exit_code -eq 0 ] && [ "$program_output" = "H" ] && [ $bad_setting_code -eq 3 ]; then 
+  echo -e "RESULT: passed${NONE}"
+else 
+  echo -e "${RED}RESULT: failed${NONE}"
+fi
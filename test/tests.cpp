@@ -2,14 +2,35 @@
 #include <cstdint>
 #include <gtest/gtest.h>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "../include/coverage.h"
+#include "../include/disasm.h"
 #include "../include/emu4380.h"
+#include "../include/loader.h"
+#include "../include/predecode.h"
+#include "../include/profiler.h"
+#include "../include/result_cache.h"
+#include "../include/smp.h"
+#include "../include/symbols.h"
+#include "../include/trace_cache.h"
 
 // helper function for initializing memory
 void initialize_memory(unsigned int size = 131072) {
 // not sure if MEM_SIZE needs to be set by me, but whatever
   MEM_SIZE = size;
+  // tests write to prog_mem directly, so start from a fresh arena rather
+  // than one that only has its tracked pages reset
+  free_mem();
   init_mem(MEM_SIZE);
 }
 
@@ -97,6 +118,50 @@ TEST(Fetch, BytesPlacedInCtrlRegs) {
   EXPECT_EQ(0xDEADBEEF, cntrl_regs[IMMEDIATE]) << "Immediate value incorrectly loaded";
 }
 
+// the by value fetch should split the instruction word the same way
+TEST(Fetch, FetchByValueMatchesCntrlRegs) {
+  initialize_memory(1024);
+  unsigned char bytes[] = {0x13, 0x05, 0x08, 0x0E, 0xEF, 0xBE, 0xAD, 0xDE};
+  for (int i = 0; i < 8; i++) {
+    prog_mem[13 + i] = bytes[i];
+  }
+
+  // fetch from an unaligned address
+  reg_file[PC] = 13;
+  Instruction inst;
+  ASSERT_TRUE(fetch(inst));
+  EXPECT_EQ(21, reg_file[PC]);
+
+  reg_file[PC] = 13;
+  ASSERT_TRUE(fetch());
+
+  EXPECT_EQ(cntrl_regs[OPERATION], inst.operation);
+  EXPECT_EQ(cntrl_regs[OPERAND_1], inst.operand_1);
+  EXPECT_EQ(cntrl_regs[OPERAND_2], inst.operand_2);
+  EXPECT_EQ(cntrl_regs[OPERAND_3], inst.operand_3);
+  EXPECT_EQ(0xDEADBEEF, inst.immediate);
+}
+
+// step runs a whole fetch, decode, execute cycle
+TEST(Fetch, StepExecutesInstruction) {
+  initialize_memory(1024);
+  // ADDI R1, R2, #5
+  unsigned char bytes[] = {ADDI, R1, R2, 0, 5, 0, 0, 0};
+  for (int i = 0; i < 8; i++) {
+    prog_mem[16 + i] = bytes[i];
+  }
+
+  reg_file[PC] = 16;
+  reg_file[R2] = 10;
+  ASSERT_TRUE(step());
+  EXPECT_EQ(15, reg_file[R1]);
+  EXPECT_EQ(24, reg_file[PC]);
+
+  // invalid operation fails the step
+  reg_file[PC] = 24;
+  ASSERT_FALSE(step());
+}
+
 // tests that fetch properly increments PC
 TEST(Fetch, IncrementsPC) {
   init_mem(1024);
@@ -231,8 +296,12 @@ TEST(Decode, InvalidOperationsFail) {
   }
 }
 
+// TRP codes added on top of the spec ones
+std::vector<unsigned int> extension_trps = {100, 101, 102, 103, 104, 105, 106, 107};
+
 TEST(Decode, ValidTRPSucceeds) {
-  unsigned int valid_trp[] = {0, 1, 2, 3, 4, 98};
+  std::vector<unsigned int> valid_trp = {0, 1, 2, 3, 4, 98};
+  valid_trp.insert(valid_trp.end(), extension_trps.begin(), extension_trps.end());
 
   for (unsigned int trp : valid_trp) {
     set_operation(TRP);
@@ -252,6 +321,9 @@ TEST(Decode, InvalidTRPFails) {
   }
 
   for (unsigned int i = 99; i < 255; i++) {
+    if (std::find(extension_trps.begin(), extension_trps.end(), i) != extension_trps.end()) {
+      continue;
+    }
     set_operation(TRP);
     set_immediate(i);
 
@@ -749,3 +821,891 @@ TEST(ExecuteTRP, ExecuteTrpNeverExits) {
     execute();
   }
 }
+
+// the profiler samples the PC while the program runs
+TEST(SampleProfile, SamplesRunningProgram) {
+  initialize_memory(1024);
+  // JMP 8 forever
+  unsigned char bytes[] = {JMP, 0, 0, 0, 8, 0, 0, 0};
+  for (int i = 0; i < 8; i++) {
+    prog_mem[8 + i] = bytes[i];
+  }
+  reg_file[PC] = 8;
+
+  ASSERT_FALSE(start_sample_profile(0));
+  // a one second period doesn't fit in nanoseconds alone
+  ASSERT_TRUE(start_sample_profile(1));
+  stop_sample_profile();
+  ASSERT_TRUE(start_sample_profile(10000));
+  auto start = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(50)) {
+    ASSERT_TRUE(step());
+  }
+  stop_sample_profile();
+
+  std::stringstream out;
+  write_sample_profile(out);
+  std::string header;
+  std::getline(out, header);
+  std::getline(out, header);
+
+  // samples land on the jump or the instruction before its target
+  unsigned long samples;
+  double percent;
+  char percent_sign;
+  unsigned int pc;
+  ASSERT_TRUE(out >> samples >> percent >> percent_sign >> pc);
+  EXPECT_GT(samples, 0);
+  EXPECT_TRUE(pc == 0 || pc == 8) << "unexpected sampled address: " << pc;
+}
+
+// addresses resolve to the closest label below them and the line that emitted them
+TEST(Symbols, LooksUpLabelsAndLines) {
+  std::string path = "symbols_test.sym";
+  {
+    std::ofstream sym_file(path);
+    sym_file << "# asm4380 symbols v1\n"
+             << "label 20 3 EXIT\n"
+             << "label 4 1 START\n"
+             << "line 4 1\n"
+             << "line 12 2\n"
+             << "line 20 3\n";
+  }
+
+  SymbolTable table;
+  ASSERT_TRUE(load_symbols(path, table));
+  std::remove(path.c_str());
+
+  EXPECT_EQ(nullptr, find_label(table, 3));
+  EXPECT_EQ("START", find_label(table, 4)->name);
+  EXPECT_EQ("START", find_label(table, 19)->name);
+  EXPECT_EQ("EXIT", find_label(table, 20)->name);
+  EXPECT_EQ(3, find_label(table, 20)->line);
+
+  EXPECT_EQ(0, find_line(table, 0));
+  EXPECT_EQ(1, find_line(table, 11));
+  EXPECT_EQ(2, find_line(table, 12));
+  EXPECT_EQ(3, find_line(table, 27));
+}
+
+// a version 1 binary is copied to address 0 as is
+TEST(Loader, ParsesVersion1) {
+  std::vector<unsigned char> bytes = {12, 0, 0, 0, 'H', 'i', 0, 0, 0, 0, 0, 0,
+                                      TRP, 0, 0, 0, 0, 0, 0, 0};
+  ProgramImage image;
+  std::string error;
+  ASSERT_TRUE(parse_image(bytes, image, error));
+  EXPECT_EQ(1, image.version);
+  EXPECT_EQ(12, image.entry);
+  EXPECT_EQ(20, image.end);
+
+  initialize_memory(1024);
+  load_image(image);
+  EXPECT_EQ(12, reg_file[PC]);
+  EXPECT_EQ('i', prog_mem[5]);
+  EXPECT_EQ(TRP, prog_mem[12]);
+}
+
+// builds a version 2 binary holding `data` with `bss` zero bytes and `code`
+std::vector<unsigned char> make_v2(std::vector<unsigned char> data, unsigned int bss,
+                                   std::vector<unsigned char> code) {
+  unsigned int code_address = 4 + data.size() + bss;
+  unsigned int fields[] = {code_address, 48, 4, (unsigned int)data.size(), bss,
+                           48 + (unsigned int)data.size(), code_address, (unsigned int)code.size()};
+  std::vector<unsigned char> bytes = {'4', '3', '8', '0', 2, 0, 48, 0};
+  for (unsigned int field : fields) {
+    for (int i = 0; i < 4; i++) {
+      bytes.push_back((field >> (8 * i)) & 0xFF);
+    }
+  }
+
+  unsigned long long hash = fnv1a_64(bytes.data(), bytes.size());
+  hash = fnv1a_64(data.data(), data.size(), hash);
+  hash = fnv1a_64(code.data(), code.size(), hash);
+  for (int i = 0; i < 8; i++) {
+    bytes.push_back((hash >> (8 * i)) & 0xFF);
+  }
+  bytes.insert(bytes.end(), data.begin(), data.end());
+  bytes.insert(bytes.end(), code.begin(), code.end());
+  return bytes;
+}
+
+// a version 2 binary lays memory out the same way as version 1
+TEST(Loader, ParsesVersion2) {
+  auto bytes = make_v2({'H', 'i'}, 6, {TRP, 0, 0, 0, 0, 0, 0, 0});
+  ProgramImage image;
+  std::string error;
+  ASSERT_TRUE(parse_image(bytes, image, error)) << error;
+  EXPECT_EQ(2, image.version);
+  EXPECT_EQ(12, image.entry);
+  EXPECT_EQ(12, image.code_start);
+  EXPECT_EQ(20, image.code_end);
+  EXPECT_EQ(20, image.end);
+
+  initialize_memory(1024);
+  load_image(image);
+  EXPECT_EQ(12, reg_file[PC]);
+  EXPECT_EQ(12, prog_mem[0]);
+  EXPECT_EQ('i', prog_mem[5]);
+  EXPECT_EQ(0, prog_mem[6]);
+  EXPECT_EQ(TRP, prog_mem[12]);
+}
+
+TEST(Loader, RejectsVersion2HashMismatch) {
+  auto bytes = make_v2({'H', 'i'}, 6, {TRP, 0, 0, 0, 0, 0, 0, 0});
+  bytes.back() = 1;
+
+  ProgramImage image;
+  std::string error;
+  ASSERT_FALSE(parse_image(bytes, image, error));
+  EXPECT_EQ("content hash mismatch", error);
+}
+
+TEST(Loader, RejectsVersion2TruncatedSegment) {
+  auto bytes = make_v2({'H', 'i'}, 6, {TRP, 0, 0, 0, 0, 0, 0, 0});
+  bytes.pop_back();
+
+  ProgramImage image;
+  std::string error;
+  ASSERT_FALSE(parse_image(bytes, image, error));
+  EXPECT_EQ("segment extends past the end of the file", error);
+}
+
+// helper for writing an instruction into memory
+void write_instruction(unsigned int address, unsigned char operation, unsigned char operand1 = 0,
+                       unsigned char operand2 = 0, unsigned int immediate = 0) {
+  prog_mem[address] = operation;
+  prog_mem[address + 1] = operand1;
+  prog_mem[address + 2] = operand2;
+  prog_mem[address + 3] = 0;
+  store_word(prog_mem + address + 4, immediate);
+}
+
+TEST(ExecuteAtomic, CasSwapsWhenEqual) {
+  initialize_memory(1024);
+  store_word(prog_mem + 100, 7);
+  reg_file[R1] = 7;
+  reg_file[R2] = 9;
+
+  set_operation(CAS);
+  set_operands(R1, R2);
+  set_immediate(100);
+  ASSERT_TRUE(decode());
+  ASSERT_TRUE(execute());
+  EXPECT_EQ(9, load_word(prog_mem + 100));
+  EXPECT_EQ(7, reg_file[R1]);
+
+  // memory no longer holds the expected value, so nothing is stored
+  reg_file[R1] = 7;
+  reg_file[R2] = 11;
+  ASSERT_TRUE(execute());
+  EXPECT_EQ(9, load_word(prog_mem + 100));
+  EXPECT_EQ(9, reg_file[R1]);
+}
+
+TEST(ExecuteAtomic, FaaAddsAndReturnsOldValue) {
+  initialize_memory(1024);
+  store_word(prog_mem + 100, 40);
+  reg_file[R2] = 2;
+
+  set_operation(FAA);
+  set_operands(R1, R2);
+  set_immediate(100);
+  ASSERT_TRUE(decode());
+  ASSERT_TRUE(execute());
+  EXPECT_EQ(42, load_word(prog_mem + 100));
+  EXPECT_EQ(40, reg_file[R1]);
+}
+
+TEST(ExecuteAtomic, UnalignedOrOutOfBoundsFails) {
+  initialize_memory(1024);
+  set_operands(R1, R2);
+
+  for (unsigned int operation : {CAS, FAA}) {
+    set_operation(operation);
+    set_immediate(102);
+    EXPECT_FALSE(execute());
+    set_immediate(1024);
+    EXPECT_FALSE(execute());
+  }
+}
+
+TEST(Smp, SpawnAndJoinCore) {
+  initialize_memory(1024);
+  // the new core stores its argument at 64 and stops
+  write_instruction(16, STR, R3, 0, 64);
+  write_instruction(24, TRP, 0, 0, 0);
+
+  // without --smp there is only core 0
+  unsigned int core_id;
+  ASSERT_FALSE(spawn_core(16, 1234, core_id));
+
+  max_cores = 2;
+  ASSERT_TRUE(spawn_core(16, 1234, core_id));
+  ASSERT_TRUE(join_core(core_id));
+  EXPECT_EQ(1234, load_word(prog_mem + 64));
+
+  // a core can only be joined once
+  EXPECT_FALSE(join_core(core_id));
+  EXPECT_FALSE(join_core(0));
+  max_cores = 1;
+}
+
+TEST(Smp, ParallelFetchAndAdd) {
+  initialize_memory(1 << 16);
+  const unsigned int adds = 2000;
+
+  // every core adds 1 to the word at 8, `adds` times
+  unsigned int address = 16;
+  write_instruction(address, MOVI, R2, 0, 1);
+  for (unsigned int i = 0; i < adds; i++) {
+    address += 8;
+    write_instruction(address, FAA, R1, R2, 8);
+  }
+  write_instruction(address + 8, TRP, 0, 0, 0);
+
+  max_cores = 4;
+  std::vector<unsigned int> core_ids(3);
+  for (auto& core_id : core_ids) {
+    ASSERT_TRUE(spawn_core(16, 0, core_id));
+  }
+  for (auto core_id : core_ids) {
+    ASSERT_TRUE(join_core(core_id));
+  }
+  max_cores = 1;
+
+  EXPECT_EQ(3 * adds, load_word(prog_mem + 8));
+}
+
+TEST(ExecuteTRP, MemcpyCopiesOverlappingRanges) {
+  initialize_memory(1024);
+  for (int i = 0; i < 16; i++) {
+    prog_mem[100 + i] = i + 1;
+  }
+  set_operation(TRP);
+  set_immediate(102);
+
+  // copy 16 bytes from 100 to 104, overlapping the source
+  reg_file[R3] = 104;
+  reg_file[R4] = 100;
+  reg_file[R5] = 16;
+  ASSERT_TRUE(execute());
+  for (int i = 0; i < 16; i++) {
+    ASSERT_EQ(i + 1, prog_mem[104 + i]);
+  }
+
+  // ranges running off the end of memory fail without copying anything
+  reg_file[R3] = 1020;
+  reg_file[R4] = 100;
+  reg_file[R5] = 8;
+  EXPECT_FALSE(execute());
+  EXPECT_EQ(0, prog_mem[1020]);
+  reg_file[R3] = 100;
+  reg_file[R5] = 0xFFFFFFFF;
+  EXPECT_FALSE(execute());
+}
+
+TEST(ExecuteTRP, MemsetFillsRange) {
+  initialize_memory(1024);
+  set_operation(TRP);
+  set_immediate(103);
+
+  reg_file[R3] = 200;
+  reg_file[R4] = 0x1AB;
+  reg_file[R5] = 824;
+  ASSERT_TRUE(execute());
+  EXPECT_EQ(0, prog_mem[199]);
+  EXPECT_EQ(0xAB, prog_mem[200]);
+  EXPECT_EQ(0xAB, prog_mem[1023]);
+
+  reg_file[R5] = 825;
+  EXPECT_FALSE(execute());
+}
+
+TEST(ExecuteTRP, MemcmpComparesRanges) {
+  initialize_memory(1024);
+  const char text[] = "abcdabce";
+  std::memcpy(prog_mem + 300, text, 8);
+  set_operation(TRP);
+  set_immediate(104);
+
+  unsigned int cases[][4] = {
+    // first, second, length, result
+    {300, 304, 3, 0},
+    {300, 304, 4, 0xFFFFFFFF},
+    {304, 300, 4, 1},
+    {300, 300, 0, 0},
+  };
+  for (auto& test_case : cases) {
+    reg_file[R3] = test_case[0];
+    reg_file[R4] = test_case[1];
+    reg_file[R5] = test_case[2];
+    ASSERT_TRUE(execute());
+    EXPECT_EQ(test_case[3], reg_file[R3]);
+  }
+
+  reg_file[R3] = 300;
+  reg_file[R4] = 1000;
+  reg_file[R5] = 30;
+  EXPECT_FALSE(execute());
+}
+
+TEST(ExecuteTRP, PrintsLengthPrefixedString) {
+  initialize_memory(1024);
+  const char text[] = "\x0bhello world";
+  std::memcpy(prog_mem + 500, text, 12);
+  set_operation(TRP);
+  set_immediate(105);
+
+  testing::internal::CaptureStdout();
+  reg_file[R3] = 500;
+  ASSERT_TRUE(execute());
+  EXPECT_EQ("hello world", testing::internal::GetCapturedStdout());
+
+  // the string can't run past the end of memory
+  prog_mem[1020] = 4;
+  reg_file[R3] = 1020;
+  EXPECT_FALSE(execute());
+  reg_file[R3] = 1024;
+  EXPECT_FALSE(execute());
+}
+
+// runs TRP #106 (allocate) or #107 (free) on R3 and returns R3
+static unsigned int heap_trap(unsigned int code, unsigned int r3) {
+  set_operation(TRP);
+  set_immediate(code);
+  reg_file[R3] = r3;
+  EXPECT_TRUE(execute());
+  return reg_file[R3];
+}
+
+TEST(ExecuteTRP, AllocatesAndFreesHeapBlocks) {
+  initialize_memory(1024);
+  // a 20 byte image, the heap starts at the next multiple of 8
+  ProgramImage image;
+  std::string error;
+  ASSERT_TRUE(parse_image(std::vector<unsigned char>(20, 0), image, error));
+  load_image(image);
+  EXPECT_EQ(24, reg_file[HP]);
+
+  // sizes round up to a power of two, at least 8
+  EXPECT_EQ(24, heap_trap(106, 1));
+  EXPECT_EQ(32, heap_trap(106, 9));
+  EXPECT_EQ(48, heap_trap(106, 16));
+  EXPECT_EQ(64, reg_file[HP]);
+
+  // freed blocks are reused by allocations of the same size
+  EXPECT_EQ(0, heap_trap(107, 32));
+  EXPECT_EQ(64, heap_trap(106, 100));
+  EXPECT_EQ(32, heap_trap(106, 12));
+  EXPECT_EQ(192, reg_file[HP]);
+
+  // freeing the top block gives its space back
+  EXPECT_EQ(0, heap_trap(107, 64));
+  EXPECT_EQ(64, reg_file[HP]);
+
+  // only allocated blocks can be freed, and only once
+  EXPECT_EQ(0xFFFFFFFF, heap_trap(107, 64));
+  EXPECT_EQ(0xFFFFFFFF, heap_trap(107, 28));
+  EXPECT_EQ(0xFFFFFFFF, heap_trap(107, 0));
+
+  // blocks must fit in memory
+  EXPECT_EQ(64, heap_trap(106, 512));
+  EXPECT_EQ(0xFFFFFFFF, heap_trap(106, 512));
+  EXPECT_EQ(0xFFFFFFFF, heap_trap(106, 0xFFFFFFFF));
+  EXPECT_EQ(576, reg_file[HP]);
+
+  // loading an image starts a new heap
+  load_image(image);
+  EXPECT_EQ(24, heap_trap(106, 8));
+}
+
+// runs DIVI/MULI R1, R2, immed from the pre-decode table
+static unsigned int run_predecoded(unsigned char operation, unsigned int immed, unsigned int n) {
+  write_instruction(8, operation, R1, R2, immed);
+  predecode(8, 16);
+  reg_file[R2] = n;
+  reg_file[PC] = 8;
+  EXPECT_NE(nullptr, find_predecoded(8));
+  EXPECT_TRUE(step());
+  return reg_file[R1];
+}
+
+TEST(Predecode, DiviMatchesHardwareDivide) {
+  initialize_memory(1024);
+  std::vector<int> divisors = {1, -1, 2, -2, 3, -3, 5, 7, -7, 10, -10, 16, -64, 100, 641, 1000000007,
+                               -1000000007, 0x40000000, 0x7FFFFFFF, -0x7FFFFFFF, INT32_MIN};
+  std::vector<int> dividends = {0, 1, -1, 2, -2, 9, -9, 99, -100, 12345, -12345, INT32_MAX, INT32_MIN + 1};
+  std::uint32_t seed = 4380;
+  for (int i = 0; i < 50; i++) {
+    seed = seed * 1664525 + 1013904223;
+    dividends.push_back((int)seed);
+  }
+
+  for (int d : divisors) {
+    for (int n : dividends) {
+      ASSERT_EQ((unsigned int)(n / d), run_predecoded(DIVI, d, n)) << n << " / " << d;
+    }
+    if (d != -1) {
+      ASSERT_EQ((unsigned int)(INT32_MIN / d), run_predecoded(DIVI, d, INT32_MIN)) << d;
+    }
+  }
+}
+
+TEST(Predecode, MuliMatchesMultiply) {
+  initialize_memory(1024);
+  std::vector<unsigned int> factors = {0, 1, 2, 3, 8, 0x80000000, 0xFFFFFFFF, 1024};
+  std::vector<unsigned int> values = {0, 1, 7, 0xFFFFFFFF, 0x12345678};
+  for (auto f : factors) {
+    for (auto v : values) {
+      ASSERT_EQ(v * f, run_predecoded(MULI, f, v));
+    }
+  }
+}
+
+TEST(Predecode, DiviByZeroFails) {
+  initialize_memory(1024);
+  write_instruction(8, DIVI, R1, R2, 0);
+  predecode(8, 16);
+  ASSERT_NE(nullptr, find_predecoded(8));
+  reg_file[PC] = 8;
+  EXPECT_FALSE(step());
+}
+
+TEST(Predecode, OverwrittenCodeIsDecodedAgain) {
+  initialize_memory(1024);
+  write_instruction(8, MOVI, R1, 0, 5);
+  write_instruction(16, 0, 0, 0, 0);
+  predecode(8, 24);
+  EXPECT_NE(nullptr, find_predecoded(8));
+  EXPECT_EQ(nullptr, find_predecoded(16));
+  EXPECT_EQ(nullptr, find_predecoded(12));
+
+  store_word(prog_mem + 12, 6);
+  EXPECT_EQ(nullptr, find_predecoded(8));
+  reg_file[PC] = 8;
+  ASSERT_TRUE(step());
+  EXPECT_EQ(6, reg_file[R1]);
+
+  write_instruction(8, DIVI, R1, R2, 0);
+  write_instruction(16, MOVI, R1, 0, 3);
+  reg_file[PC] = 8;
+  EXPECT_FALSE(step());
+  reg_file[PC] = 16;
+  ASSERT_TRUE(step());
+  EXPECT_EQ(3, reg_file[R1]);
+}
+
+TEST(Predecode, LoadsAndStoresInBoundsSkipTheCheck) {
+  initialize_memory(1024);
+  write_instruction(8, LDR, R1, 0, 1020);
+  write_instruction(16, STB, R1, 0, 1023);
+  write_instruction(24, STR, R1, 0, 1021);
+  write_instruction(32, LDB, R1, 0, 1024);
+  predecode(8, 40);
+
+  EXPECT_TRUE(find_predecoded(8)->address_checked);
+  EXPECT_TRUE(find_predecoded(16)->address_checked);
+  EXPECT_FALSE(find_predecoded(24)->address_checked);
+  EXPECT_FALSE(find_predecoded(32)->address_checked);
+
+  // out of bounds ones still fail
+  reg_file[PC] = 24;
+  EXPECT_FALSE(step());
+  reg_file[PC] = 32;
+  EXPECT_FALSE(step());
+}
+
+TEST(RunLoop, CountsAndTracesOnlyWhenSelected) {
+  initialize_memory(1024);
+  write_instruction(8, MOVI, R1, 0, 5);
+  write_instruction(16, STR, R1, 0, 100);
+  write_instruction(24, TRP, 0, 0, 0);
+  predecode(8, 32);
+  std::memset(instruction_counts, 0, sizeof(instruction_counts));
+
+  unsigned int failed;
+  reg_file[PC] = 8;
+  testing::internal::CaptureStderr();
+  ASSERT_TRUE(run_loop(failed));
+  EXPECT_EQ("", testing::internal::GetCapturedStderr());
+  EXPECT_EQ(0, instruction_counts[MOVI]);
+  flag = NOTHING;
+
+  RunLoop production = run_loop;
+  run_loop = select_run_loop(false, true, true, false);
+  reg_file[PC] = 8;
+  testing::internal::CaptureStderr();
+  ASSERT_TRUE(run_loop(failed));
+  EXPECT_EQ("TRACE 8: 8 1 0 0 5\nTRACE 16: 10 1 0 0 100\nTRACE 24: 31 0 0 0 0\n",
+            testing::internal::GetCapturedStderr());
+  EXPECT_EQ(1, instruction_counts[MOVI]);
+  EXPECT_EQ(1, instruction_counts[STR]);
+  EXPECT_EQ(1, instruction_counts[TRP]);
+  flag = NOTHING;
+
+  std::ostringstream counts;
+  write_instruction_counts(counts);
+  EXPECT_EQ("instructions\t3\nMOVI\t1\nSTR\t1\nTRP\t1\n", counts.str());
+
+  // invalid instructions are reported with their address
+  write_instruction(24, 0, 0, 0, 0);
+  reg_file[PC] = 8;
+  testing::internal::CaptureStderr();
+  EXPECT_FALSE(run_loop(failed));
+  testing::internal::GetCapturedStderr();
+  EXPECT_EQ(24, failed);
+  run_loop = production;
+}
+
+TEST(RunLoop, CoverageMarksExecutedSlots) {
+  initialize_memory(1024);
+  write_instruction(12, JMP, 0, 0, 28);
+  write_instruction(20, MOVI, R1, 0, 1);
+  write_instruction(28, TRP, 0, 0, 0);
+  ASSERT_TRUE(start_coverage());
+
+  RunLoop production = run_loop;
+  run_loop = select_run_loop(false, false, false, true);
+  unsigned int failed;
+  reg_file[PC] = 12;
+  ASSERT_TRUE(run_loop(failed));
+  flag = NOTHING;
+  run_loop = production;
+
+  SymbolTable symbols;
+  symbols.labels = {{4, 1, "DATA"}, {12, 2, "MAIN"}, {20, 3, "SKIPPED"}, {28, 4, "END"}, {28, 5, "ALSO_END"}};
+  std::ostringstream report;
+  write_coverage(report, 12, 36, &symbols);
+  EXPECT_EQ("covered 2 3\n"
+            "label MAIN 1 1\n"
+            "label SKIPPED 0 1\n"
+            "label END 1 1\n"
+            "label ALSO_END 1 1\n"
+            "bitmap 12 3\n"
+            "05\n", report.str());
+
+  delete[] coverage_map;
+  coverage_map = nullptr;
+}
+
+TEST(ResultCache, KeyCoversImageMemoryAndInput) {
+  std::vector<unsigned char> image = {8, 0, 0, 0, 31, 0, 0, 0, 0, 0, 0, 0};
+  std::vector<unsigned char> input = {'1', '\n'};
+  auto key = result_key(image, 1024, input);
+  EXPECT_EQ(32, key.size());
+  EXPECT_EQ(key, result_key(image, 1024, input));
+  EXPECT_NE(key, result_key(image, 2048, input));
+  EXPECT_NE(key, result_key(image, 1024, {'2', '\n'}));
+
+  // moving a byte from the image to the input changes the key
+  std::vector<unsigned char> shorter(image.begin(), image.end() - 1);
+  std::vector<unsigned char> longer = {0, '1', '\n'};
+  EXPECT_NE(key, result_key(shorter, 1024, longer));
+}
+
+TEST(ResultCache, EvictsLeastRecentlyUsed) {
+  char dir_template[] = "/tmp/emu4380_results_XXXXXX";
+  std::string dir = mkdtemp(dir_template);
+  // entries of 1 KiB, last used in the order a, b, c
+  const char* names[] = {"a", "b", "c"};
+  for (int i = 0; i < 3; i++) {
+    std::string path = dir + "/" + names[i];
+    std::ofstream(path) << std::string(1024, 'x');
+    struct timespec times[2] = {{1000 + i, 0}, {1000 + i, 0}};
+    utimensat(AT_FDCWD, path.c_str(), times, 0);
+  }
+
+  auto exists = [&](const char* name) { return std::ifstream(dir + "/" + name).good(); };
+  evict_results(dir, 3 * 1024, "c");
+  EXPECT_TRUE(exists("a") && exists("b") && exists("c"));
+  evict_results(dir, 2 * 1024, "c");
+  EXPECT_TRUE(!exists("a") && exists("b") && exists("c"));
+  // the entry just written stays even if it alone is over the limit
+  evict_results(dir, 0, "b");
+  EXPECT_TRUE(exists("b") && !exists("c"));
+
+  std::remove((dir + "/b").c_str());
+  rmdir(dir.c_str());
+}
+
+TEST(Loader, ReadsFramedImageAndLeavesTheRest) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  const unsigned char stream[] = {3, 0, 0, 0, 'a', 'b', 'c', 'x', 'y'};
+  ASSERT_EQ((ssize_t)sizeof(stream), write(fds[1], stream, sizeof(stream)));
+  close(fds[1]);
+
+  std::vector<unsigned char> image;
+  ASSERT_TRUE(read_framed_image(fds[0], image));
+  EXPECT_EQ(std::vector<unsigned char>({'a', 'b', 'c'}), image);
+  char rest[4];
+  EXPECT_EQ(2, read(fds[0], rest, sizeof(rest)));
+  // a frame longer than the stream
+  EXPECT_FALSE(read_framed_image(fds[0], image));
+  close(fds[0]);
+}
+
+TEST(InitMem, ReusesArenaAndResetsDirtyPages) {
+  initialize_memory(3 * 4096 + 100);
+  unsigned char* arena = prog_mem;
+
+  set_operation(STR);
+  set_operands(R1);
+  set_immediate(4096 + 10);
+  reg_file[R1] = 0xDEADBEEF;
+  ASSERT_TRUE(execute());
+  set_operation(STB);
+  set_immediate(3 * 4096 + 99);
+  ASSERT_TRUE(execute());
+  reg_file[R3] = 4096 + 200;
+  reg_file[R4] = 0xAA;
+  reg_file[R5] = 4096 - 200;
+  set_operation(TRP);
+  set_immediate(103);
+  ASSERT_TRUE(execute());
+
+  EXPECT_EQ(0, mem_dirty[0]);
+  EXPECT_EQ(1, mem_dirty[1]);
+  EXPECT_EQ(0, mem_dirty[2]);
+  EXPECT_EQ(1, mem_dirty[3]);
+
+  ASSERT_TRUE(init_mem(3 * 4096 + 100));
+  EXPECT_EQ(arena, prog_mem);
+  for (unsigned int i = 0; i < MEM_SIZE; i++) {
+    ASSERT_EQ(0, prog_mem[i]) << i;
+  }
+  for (int page = 0; page < 4; page++) {
+    EXPECT_EQ(0, mem_dirty[page]);
+  }
+
+  // a different size gets a new arena
+  ASSERT_TRUE(init_mem(4096));
+  EXPECT_EQ(4096, MEM_SIZE);
+  EXPECT_EQ(0, mem_dirty[0]);
+}
+
+TEST(InitMem, HugePagesAreAlignedAndReset) {
+  huge_page_mode = HUGE_PAGES_ON;
+  initialize_memory(2 * HUGE_PAGE_SIZE + 100);
+  EXPECT_EQ(0, (std::uintptr_t)prog_mem % HUGE_PAGE_SIZE);
+
+  set_operation(STR);
+  set_operands(R1);
+  set_immediate(2 * HUGE_PAGE_SIZE + 96);
+  reg_file[R1] = 0xDEADBEEF;
+  ASSERT_TRUE(execute());
+  ASSERT_TRUE(init_mem(MEM_SIZE));
+  EXPECT_EQ(0, load_word(prog_mem + 2 * HUGE_PAGE_SIZE + 96));
+
+  // smaller than a huge page, or turned off
+  initialize_memory(HUGE_PAGE_SIZE - 4096);
+  EXPECT_FALSE(mem_huge_pages);
+  huge_page_mode = HUGE_PAGES_OFF;
+  initialize_memory(2 * HUGE_PAGE_SIZE);
+  EXPECT_FALSE(mem_huge_pages);
+  huge_page_mode = HUGE_PAGES_AUTO;
+}
+
+TEST(InitMem, LoadedImageIsReset) {
+  initialize_memory(8192);
+  std::vector<unsigned char> bytes = {8, 0, 0, 0, 0, 0, 0, 0, 31, 0, 0, 0, 0, 0, 0, 0};
+  ProgramImage image;
+  std::string error;
+  ASSERT_TRUE(parse_image(bytes, image, error));
+  load_image(image);
+  EXPECT_EQ(1, mem_dirty[0]);
+
+  ASSERT_TRUE(init_mem(8192));
+  EXPECT_EQ(0, load_word(prog_mem));
+  EXPECT_EQ(0, prog_mem[8]);
+}
+
+TEST(Disassembler, WritesAssemblyText) {
+  EXPECT_EQ("MOV R1, PC", disassemble({MOV, R1, PC, 0, 0}));
+  EXPECT_EQ("ADD R1, R2, R3", disassemble({ADD, R1, R2, R3, 0}));
+  EXPECT_EQ("SUBI SP, SP, #-4", disassemble({SUBI, SP, SP, 0, (unsigned int)-4}));
+  EXPECT_EQ("TRP #98", disassemble({TRP, 0, 0, 0, 98}));
+  EXPECT_EQ("MEMSET", disassemble({TRP, 0, 0, 0, 103}));
+  EXPECT_EQ("INVALID 2 0 0 0 #0", disassemble({2, 0, 0, 0, 0}));
+
+  SymbolTable symbols;
+  symbols.labels = {{16, 1, "LOOP"}};
+  EXPECT_EQ("JMP LOOP", disassemble({JMP, 0, 0, 0, 16}, &symbols));
+  EXPECT_EQ("LDR R1, #20", disassemble({LDR, R1, 0, 0, 20}, &symbols));
+}
+
+TEST(Disassembler, SplitsBlocksAndFindsLoops) {
+  initialize_memory(1024);
+  // 8: spawn a core at 64, then loop at 24 forever
+  write_instruction(8, LDA, R3, 0, 64);
+  write_instruction(16, TRP, 0, 0, 100);
+  write_instruction(24, ADDI, R1, R1, 1);
+  write_instruction(32, JMP, 0, 0, 24);
+  // nothing jumps here
+  write_instruction(40, MOVI, R1, 0, 5);
+  write_instruction(48, TRP, 0, 0, 0);
+  write_instruction(56, TRP, 0, 0, 0);
+  // the spawned core returns through a register
+  write_instruction(64, MOV, PC, R5);
+
+  ProgramImage image;
+  image.entry = 8;
+  image.code_start = 8;
+  image.code_end = 72;
+  ControlFlowGraph cfg = build_cfg(image);
+
+  ASSERT_EQ(5, cfg.blocks.size());
+  std::vector<unsigned int> starts;
+  for (auto& block : cfg.blocks) {
+    starts.push_back(block.start);
+  }
+  EXPECT_EQ(std::vector<unsigned int>({8, 24, 40, 56, 64}), starts);
+
+  EXPECT_EQ(std::vector<unsigned int>({1}), cfg.blocks[0].successors);
+  EXPECT_EQ(std::vector<unsigned int>({1}), cfg.blocks[1].successors);
+  EXPECT_TRUE(cfg.blocks[2].successors.empty());
+  EXPECT_TRUE(cfg.blocks[4].indirect);
+
+  EXPECT_TRUE(cfg.blocks[0].reachable);
+  EXPECT_TRUE(cfg.blocks[1].reachable);
+  EXPECT_FALSE(cfg.blocks[2].reachable);
+  EXPECT_FALSE(cfg.blocks[3].reachable);
+  EXPECT_TRUE(cfg.blocks[4].reachable);
+
+  ASSERT_EQ(1, cfg.loops.size());
+  EXPECT_EQ(1, cfg.loops[0].header);
+  EXPECT_EQ(std::vector<unsigned int>({1}), cfg.loops[0].blocks);
+  EXPECT_EQ(1, cfg.blocks[1].loop_depth);
+  EXPECT_EQ(0, cfg.blocks[0].loop_depth);
+
+  EXPECT_EQ(1, cfg.blocks[1].mix["ADDI"]);
+  EXPECT_EQ(1, cfg.blocks[1].mix["JMP"]);
+
+  std::ostringstream dot;
+  write_cfg_dot(dot, cfg);
+  EXPECT_NE(std::string::npos, dot.str().find("B1 -> B1;"));
+  EXPECT_NE(std::string::npos, dot.str().find("style=dashed"));
+}
+
+// ALLOC replaces R3, so a following spawn has no known entry
+TEST(Disassembler, AllocatedAddressIsNotASpawnedCore) {
+  initialize_memory(1024);
+  write_instruction(8, MOVI, R3, 0, 40);
+  write_instruction(16, TRP, 0, 0, 106);
+  write_instruction(24, TRP, 0, 0, 100);
+  write_instruction(32, TRP, 0, 0, 0);
+  write_instruction(40, TRP, 0, 0, 0);
+
+  ProgramImage image;
+  image.entry = 8;
+  image.code_start = 8;
+  image.code_end = 48;
+  ControlFlowGraph cfg = build_cfg(image);
+
+  ASSERT_EQ(2, cfg.blocks.size());
+  EXPECT_EQ(40, cfg.blocks[1].start);
+  EXPECT_TRUE(cfg.blocks[0].reachable);
+  EXPECT_FALSE(cfg.blocks[1].reachable);
+}
+
+// MOVI PC and LDA PC jump to their immediate like JMP
+TEST(Disassembler, FollowsConstantWritesToPC) {
+  initialize_memory(1024);
+  write_instruction(8, MOVI, PC, 0, 24);
+  write_instruction(16, TRP, 0, 0, 0);
+  write_instruction(24, ADDI, R1, R1, 1);
+  write_instruction(32, LDA, PC, 0, 24);
+
+  ProgramImage image;
+  image.entry = 8;
+  image.code_start = 8;
+  image.code_end = 40;
+  ControlFlowGraph cfg = build_cfg(image);
+
+  ASSERT_EQ(3, cfg.blocks.size());
+  EXPECT_EQ(std::vector<unsigned int>({2}), cfg.blocks[0].successors);
+  EXPECT_EQ(std::vector<unsigned int>({2}), cfg.blocks[2].successors);
+  EXPECT_FALSE(cfg.blocks[2].indirect);
+  EXPECT_FALSE(cfg.blocks[1].reachable);
+  ASSERT_EQ(1, cfg.loops.size());
+  EXPECT_EQ(2, cfg.loops[0].header);
+}
+
+// Writes a loop counting R1 up from LOOP (16) that leaves through a jump to
+// R7, which is LOOP while R2 / 100 is 1 and exit after: the loop runs 101
+// times from R2 = 200. The jump is `MOV PC, R7` at exit - 8, or with
+// patch_jmp a `JMP LOOP` at exit - 8 whose immediate is overwritten with R7.
+static void write_counting_loop(unsigned int exit, bool patch_jmp) {
+  write_instruction(8, MOVI, R2, 0, 200);
+  write_instruction(16, ADDI, R1, R1, 1);
+  write_instruction(24, SUBI, R2, R2, 1);
+  write_instruction(32, DIVI, R8, R2, 100);
+  write_instruction(40, MULI, R8, R8, exit - 16);
+  write_instruction(48, MOVI, R7, 0, exit);
+  write_instruction(56, SUB, R7, R7);
+  prog_mem[59] = R8;
+  if (patch_jmp) {
+    write_instruction(64, STR, R7, 0, exit - 4);
+    write_instruction(72, JMP, 0, 0, 16);
+  }
+  else {
+    write_instruction(64, MOV, PC, R7);
+  }
+  write_instruction(exit, TRP, 0, 0, 0);
+  predecode(8, exit + 8);
+}
+
+TEST(HotTraces, ReplayMatchesInterpretingAndTakesSideExits) {
+  for (bool enabled : {false, true}) {
+    initialize_memory(1024);
+    write_counting_loop(72, false);
+    hot_traces_enabled = enabled;
+    reg_file[R1] = 0;
+    reg_file[PC] = 8;
+
+    unsigned int failed;
+    ASSERT_TRUE(run_loop(failed));
+    flag = NOTHING;
+    EXPECT_EQ(101, reg_file[R1]);
+    EXPECT_EQ(99, reg_file[R2]);
+    EXPECT_EQ(80, reg_file[PC]);
+
+    // the loop was recorded, and the trace is still good
+    bool record;
+    EXPECT_EQ(enabled, jumped_to(16, record) != nullptr);
+  }
+  hot_traces_enabled = false;
+}
+
+TEST(HotTraces, StoreIntoTheTraceEndsReplay) {
+  initialize_memory(1024);
+  write_counting_loop(80, true);
+  hot_traces_enabled = true;
+  reg_file[R1] = 0;
+  reg_file[PC] = 8;
+
+  // the STR rewrites the JMP with the same target until the last iteration
+  unsigned int failed;
+  ASSERT_TRUE(run_loop(failed));
+  flag = NOTHING;
+  EXPECT_EQ(101, reg_file[R1]);
+  EXPECT_EQ(88, reg_file[PC]);
+
+  // and then the trace no longer matches memory
+  bool record;
+  EXPECT_EQ(nullptr, jumped_to(16, record));
+
+  // failing instructions in a trace are reported with their address
+  initialize_memory(1024);
+  write_counting_loop(80, true);
+  write_instruction(32, DIV, R8, R2);
+  prog_mem[35] = R2;
+  predecode(8, 88);
+  reg_file[PC] = 8;
+  EXPECT_FALSE(run_loop(failed));
+  EXPECT_EQ(32, failed);
+  EXPECT_EQ(0, reg_file[R2]);
+  EXPECT_NE(nullptr, jumped_to(16, record));
+  hot_traces_enabled = false;
+}